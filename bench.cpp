@@ -0,0 +1,565 @@
+// Benchmarks of the converter: microbenchmarks of its kernels, and end to end
+// conversions of a generated corpus whose shape can be tuned.  pdf2text.cpp is
+// compiled in to reach its internals.
+#include "pdf2text.cpp"
+
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+
+// work done by the iterations of a benchmark
+struct BenchCounters
+{
+	uint64_t bytes{0};
+	uint64_t items{0};
+};
+
+struct BenchOptions
+{
+	double minTime{0.5};
+	// only the benchmarks whose name contains it
+	std::string filter;
+};
+
+void PrintHeader()
+{
+	std::cout << std::left << std::setw( 36 ) << "benchmark" << std::right
+			  << std::setw( 14 ) << "ns/iter" << std::setw( 12 ) << "MB/s"
+			  << std::setw( 14 ) << "objects/s" << std::setw( 12 )
+			  << "iters" << std::setw( 12 ) << "peak MB" << "\n";
+}
+
+// Run i_body, which adds the work it did to its counters, with more and more
+// iterations until they last the minimum time, Google Benchmark style.
+template <typename F>
+void RunBenchmark( const BenchOptions &i_options, const std::string &i_name,
+				   F i_body )
+{
+	if ( i_name.find( i_options.filter ) == std::string::npos )
+		return;
+	typedef std::chrono::steady_clock clock;
+	for ( size_t iterations = 1;; )
+	{
+		BenchCounters counters;
+		auto start = clock::now();
+		for ( size_t i = 0; i < iterations; ++i )
+			i_body( counters );
+		double seconds =
+			std::chrono::duration<double>( clock::now() - start ).count();
+		if ( seconds < i_options.minTime and iterations < 1000000000 )
+		{
+			// aim a bit past the minimum time, growing at most 100 times
+			double scale =
+				seconds > 0 ? i_options.minTime * 1.2 / seconds : 100;
+			iterations = std::max<size_t>(
+				iterations + 1, iterations * std::min( scale, 100.0 ) );
+			continue;
+		}
+
+		std::cout << std::left << std::setw( 36 ) << i_name << std::right
+				  << std::fixed << std::setprecision( 1 ) << std::setw( 14 )
+				  << seconds * 1e9 / iterations << std::setw( 12 )
+				  << counters.bytes / seconds / 1e6 << std::setw( 14 )
+				  << std::setprecision( 0 ) << counters.items / seconds
+				  << std::setw( 12 ) << iterations << std::setw( 12 )
+				  << PeakRSS() / ( 1 << 20 ) << std::endl;
+		return;
+	}
+}
+
+// discards what is written, to only measure the serialization
+class NullSink : public OutputSink
+{
+protected:
+	void output( const char *, size_t, bool ) override {}
+	bool unbuffered() const override { return false; }
+};
+
+// deterministic pseudo random bytes
+void RandomBytes( uint64_t i_seed, size_t i_size, std::string &o_bytes )
+{
+	o_bytes.resize( i_size );
+	uint64_t h = i_seed;
+	for ( size_t i = 0; i < i_size; i += 8 )
+	{
+		h = hashMix( h + 0x9e3779b97f4a7c15ull );
+		memcpy( &o_bytes[i], &h, std::min<size_t>( 8, i_size - i ) );
+	}
+}
+
+void BenchEncoders( const BenchOptions &i_options )
+{
+	for ( size_t size : {size_t( 4096 ), size_t( 1 ) << 20} )
+	{
+		std::string src, text;
+		RandomBytes( size, size, src );
+		auto bytes = (const UInt8 *)src.data();
+		std::unique_ptr<char[]> dst( new char[2 * hexEncodedSize( size )] );
+		auto suffix = "/" + std::to_string( size );
+
+		RunBenchmark( i_options, "hex/scalar" + suffix,
+					  [&]( BenchCounters &c ) {
+						  hexEncodeLinesScalar( bytes, size / kHexBytesPerLine,
+												dst.get() );
+						  c.bytes += size;
+					  } );
+		RunBenchmark( i_options, "hex/dispatch" + suffix,
+					  [&]( BenchCounters &c ) {
+						  hexEncode( bytes, size, dst.get() );
+						  c.bytes += size;
+					  } );
+		RunBenchmark( i_options, "ascii85/dispatch" + suffix,
+					  [&]( BenchCounters &c ) {
+						  ascii85Encode( bytes, size, dst.get() );
+						  c.bytes += size;
+					  } );
+
+		// content stream like text, classified to the end
+		text.assign( size, 'a' );
+		for ( size_t i = 0; i < size; i += 80 )
+			text[i] = '\n';
+		RunBenchmark( i_options, "text/classify" + suffix,
+					  [&]( BenchCounters &c ) {
+						  if ( not isTextData( (const UInt8 *)text.data(),
+											   text.size() ) )
+							  abort();
+						  c.bytes += size;
+					  } );
+	}
+}
+
+// dictionaries and arrays of the shape found in page trees and resources
+void BenchObjects( const BenchOptions &i_options )
+{
+	Arena arena;
+	SymbolTable symbols( arena );
+	const char *keys[] = {"Type",	 "Subtype",  "BaseFont", "FirstChar",
+						  "LastChar", "Widths",  "Encoding", "Matrix",
+						  "BBox",	 "Resources", "Name",	 "Flags"};
+	std::vector<Symbol> keySymbols;
+	for ( auto key : keys )
+		keySymbols.push_back( symbols.intern( key ) );
+
+	const size_t dictCount = 256;
+	std::vector<PDFObject *> dicts;
+	size_t objects = 0;
+	for ( size_t d = 0; d < dictCount; ++d )
+	{
+		auto dict = arena.make<PDFDictionary>( arena, symbols,
+											   keySymbols.size() );
+		for ( size_t k = 0; k < keySymbols.size(); ++k )
+		{
+			PDFObject *value;
+			switch ( k % 4 )
+			{
+				case 0:
+					value = arena.make<PDFName>( symbols, keySymbols[k] );
+					break;
+				case 1:
+					value = arena.make<PDFNumber>( int( d * k ) );
+					break;
+				case 2:
+					value = arena.make<PDFString>( arena, "Helvetica", 9 );
+					break;
+				default:
+				{
+					auto array = arena.make<PDFArray>( arena, 16 );
+					for ( size_t i = 0; i < 16; ++i )
+						array->addValue( arena.make<PDFNumber>(
+							( ( d + i * 37 ) % 1000 ) / 100.0 ) );
+					value = array;
+					objects += 16;
+					break;
+				}
+			}
+			dict->addValue( keySymbols[k], value );
+			++objects;
+		}
+		dicts.push_back( dict );
+		++objects;
+	}
+
+	NullSink sink;
+	RunBenchmark( i_options, "write/objects", [&]( BenchCounters &c ) {
+		uint64_t start = sink.offset();
+		for ( auto &it : dicts )
+			WriteObject( sink, it );
+		c.bytes += sink.offset() - start;
+		c.items += objects;
+	} );
+
+	RunBenchmark( i_options, "dict/lookup", [&]( BenchCounters &c ) {
+		size_t found = 0;
+		for ( auto &it : dicts )
+		{
+			auto dict = it->asDictionary();
+			for ( auto key : keySymbols )
+				found += dict->value( key ) != nullptr;
+		}
+		if ( found != dicts.size() * keySymbols.size() )
+			abort();
+		c.items += found;
+	} );
+
+	RunBenchmark( i_options, "dict/lookup-missing", [&]( BenchCounters &c ) {
+		size_t found = 0;
+		for ( auto &it : dicts )
+			found += it->asDictionary()->value( sym_Contents ) != nullptr;
+		if ( found != 0 )
+			abort();
+		c.items += dicts.size();
+	} );
+}
+
+// shape of the generated documents
+struct CorpusShape
+{
+	size_t files{4};
+	// indirect objects per document, about
+	size_t objects{4000};
+	// nesting of the direct dictionaries and arrays in each page
+	size_t depth{4};
+	// bytes of each image stream
+	size_t streamSize{64 * 1024};
+	// fraction of the pages using the shared resources instead of their own
+	double share{0.5};
+};
+
+// Writes an uncompressed PDF and its xref, object by object.
+class CorpusWriter
+{
+public:
+	CorpusWriter( std::ostream &o_out ) : _out( o_out )
+	{
+		_out << "%PDF-1.7\n%\xe2\xe3\xcf\xd3\n";
+	}
+
+	size_t reserve()
+	{
+		_offsets.push_back( 0 );
+		return _offsets.size();
+	}
+
+	void begin( size_t i_id )
+	{
+		_offsets[i_id - 1] = _out.tellp();
+		_out << i_id << " 0 obj\n";
+	}
+	void end() { _out << "\nendobj\n"; }
+
+	void stream( size_t i_id, const std::string &i_dict,
+				 const std::string &i_data )
+	{
+		begin( i_id );
+		_out << "<<" << i_dict << " /Length " << i_data.size()
+			 << " >>\nstream\n";
+		_out.write( i_data.data(), i_data.size() );
+		_out << "\nendstream";
+		end();
+	}
+
+	void finish( size_t i_root )
+	{
+		auto startXref = _out.tellp();
+		_out << "xref\n0 " << _offsets.size() + 1
+			 << "\n0000000000 65535 f \n";
+		for ( auto offset : _offsets )
+		{
+			char line[32];
+			snprintf( line, sizeof( line ), "%010llu 00000 n \n",
+					  (unsigned long long)offset );
+			_out << line;
+		}
+		_out << "trailer\n<< /Size " << _offsets.size() + 1 << " /Root "
+			 << i_root << " 0 R >>\nstartxref\n"
+			 << startXref << "\n%%EOF\n";
+	}
+
+	size_t count() const { return _offsets.size(); }
+
+private:
+	std::ostream &_out;
+	std::vector<uint64_t> _offsets;
+};
+
+// direct objects nested i_depth times, like the private data of editors
+std::string NestedValue( size_t i_depth, uint64_t i_seed )
+{
+	if ( i_depth == 0 )
+		return std::to_string( i_seed % 1000 ) + "." +
+			   std::to_string( i_seed % 7 );
+	if ( i_depth % 2 == 0 )
+		return "[ /Item" + std::to_string( i_depth ) + " (value) " +
+			   NestedValue( i_depth - 1, hashMix( i_seed ) ) + " true ]";
+	return "<< /Level " + std::to_string( i_depth ) + " /Next " +
+		   NestedValue( i_depth - 1, hashMix( i_seed ) ) + " >>";
+}
+
+// Write a document of about i_shape.objects objects.  Returns their count.
+size_t WriteCorpusFile( const std::string &i_path, const CorpusShape &i_shape,
+						uint64_t i_seed )
+{
+	std::ofstream out( i_path, std::ios::binary );
+	if ( not out )
+		throw std::runtime_error( "cannot create corpus file" );
+	CorpusWriter w( out );
+	size_t catalog = w.reserve(), pages = w.reserve();
+
+	// resources of the pages that share them
+	std::string image;
+	size_t sharedImage = w.reserve(), sharedFont = w.reserve();
+	RandomBytes( i_seed, i_shape.streamSize, image );
+	std::string imageDict = " /Type /XObject /Subtype /Image /Width " +
+							std::to_string( i_shape.streamSize ) +
+							" /Height 1 /ColorSpace /DeviceGray "
+							"/BitsPerComponent 8";
+	w.stream( sharedImage, imageDict, image );
+	std::string fontDict =
+		"<< /Type /Font /Subtype /Type1 /BaseFont /Helvetica >>";
+	w.begin( sharedFont );
+	out << fontDict;
+	w.end();
+
+	// page, contents, and without sharing an image and a font
+	double perPage = 2 + 2 * ( 1 - i_shape.share );
+	size_t pageCount = std::max<size_t>( 1, i_shape.objects / perPage );
+	std::vector<size_t> kids;
+	std::string contents;
+	for ( size_t p = 0; p < pageCount; ++p )
+	{
+		uint64_t h = hashMix( i_seed ^ ( p + 1 ) );
+		bool shared = ( h % 1000 ) < i_shape.share * 1000;
+		size_t img = sharedImage, font = sharedFont;
+		if ( not shared )
+		{
+			img = w.reserve();
+			RandomBytes( h, i_shape.streamSize, image );
+			w.stream( img, imageDict, image );
+			font = w.reserve();
+			w.begin( font );
+			out << fontDict;
+			w.end();
+		}
+
+		contents = "q 100 0 0 1 72 72 cm /Im0 Do Q\nBT /F1 12 Tf\n";
+		for ( size_t line = 0; line < 40; ++line )
+			contents += "72 " + std::to_string( 720 - line * 14 ) +
+						" Td (Page " + std::to_string( p + 1 ) +
+						" line of text) Tj\n";
+		contents += "ET";
+		size_t content = w.reserve();
+		w.stream( content, "", contents );
+
+		size_t page = w.reserve();
+		w.begin( page );
+		out << "<< /Type /Page /Parent " << pages
+			<< " 0 R /MediaBox [ 0 0 612 792 ] /Contents " << content
+			<< " 0 R /Resources << /XObject << /Im0 " << img
+			<< " 0 R >> /Font << /F1 " << font << " 0 R >> >> /PieceInfo "
+			<< NestedValue( i_shape.depth, h ) << " >>";
+		w.end();
+		kids.push_back( page );
+	}
+
+	w.begin( pages );
+	out << "<< /Type /Pages /Count " << kids.size() << " /Kids [";
+	for ( auto kid : kids )
+		out << " " << kid << " 0 R";
+	out << " ] >>";
+	w.end();
+	w.begin( catalog );
+	out << "<< /Type /Catalog /Pages " << pages << " 0 R >>";
+	w.end();
+	w.finish( catalog );
+	if ( not out.flush() )
+		throw std::runtime_error( "cannot write corpus file" );
+	return w.count();
+}
+
+struct CorpusFile
+{
+	std::string path;
+	uint64_t size;
+	// indirect objects
+	size_t objects;
+};
+
+std::vector<CorpusFile> WriteCorpus( const std::string &i_dir,
+									 const CorpusShape &i_shape )
+{
+	std::vector<CorpusFile> files;
+	for ( size_t i = 0; i < i_shape.files; ++i )
+	{
+		CorpusFile file;
+		file.path = i_dir + "/corpus-" + std::to_string( i ) + ".pdf";
+		file.objects = WriteCorpusFile( file.path, i_shape, i + 1 );
+		struct stat st;
+		file.size = stat( file.path.c_str(), &st ) == 0 ? st.st_size : 0;
+		files.push_back( file );
+	}
+	return files;
+}
+
+void BenchConversions( const BenchOptions &i_options,
+					   const std::vector<CorpusFile> &i_files )
+{
+	struct Variant
+	{
+		const char *name;
+		size_t threads;
+		SaveOptions save;
+	};
+	std::vector<Variant> variants( 7 );
+	variants[0].name = "convert/hex";
+	variants[1].name = "convert/ascii85";
+	variants[1].save.encoding = encoding_ascii85;
+	variants[2].name = "convert/flate";
+	variants[2].save.flate = true;
+	variants[3].name = "convert/dedupe";
+	variants[3].save.dedupe = true;
+	variants[3].save.dedupeContainers = true;
+	variants[4].name = "convert/threads";
+	variants[4].threads = std::max( 2u, std::thread::hardware_concurrency() );
+	variants[5].name = "convert/optimize-size";
+	variants[5].save.optimize = optimize_size;
+	variants[6].name = "convert/optimize-speed";
+	variants[6].save.optimize = optimize_speed;
+
+	for ( auto &variant : variants )
+	{
+		std::unique_ptr<WorkerPool> pool;
+		if ( variant.threads > 1 )
+			pool.reset( new WorkerPool( variant.threads ) );
+		RunBenchmark( i_options, variant.name, [&]( BenchCounters &c ) {
+			for ( auto &it : i_files )
+			{
+				NullSink sink;
+				ConvertFile( it.path, sink, variant.save, pool.get(), nullptr );
+				c.bytes += it.size;
+				c.items += it.objects;
+			}
+		} );
+	}
+}
+
+void PrintBenchUsage( const char *i_name )
+{
+	std::cout << "usage: " << i_name << " [options] [file...]\n"
+			  << "  --min-time S      run each benchmark at least S seconds\n"
+			  << "  --filter F        only the benchmarks whose name has F\n"
+			  << "  --corpus-dir d    generate the corpus in d, $TMPDIR by "
+				 "default\n"
+			  << "  --generate        only generate the corpus, and keep it\n"
+			  << "  --files N         documents in the corpus\n"
+			  << "  --objects N       objects in each document\n"
+			  << "  --depth N         nesting of the direct objects\n"
+			  << "  --stream-size N   bytes of each image\n"
+			  << "  --share R         fraction of the pages sharing their "
+				 "resources, 0 to 1\n"
+			  << "The given files are converted instead of the corpus.\n"
+			  << std::endl;
+}
+
+// match "name value" or "name=value" at argv[io_i]
+bool BenchOptionValue( int argc, char *const argv[], int &io_i,
+					   const std::string &i_name, std::string &o_value )
+{
+	std::string arg = argv[io_i];
+	if ( arg == i_name and io_i + 1 < argc )
+	{
+		o_value = argv[++io_i];
+		return true;
+	}
+	if ( arg.compare( 0, i_name.size() + 1, i_name + "=" ) == 0 )
+	{
+		o_value = arg.substr( i_name.size() + 1 );
+		return true;
+	}
+	return false;
+}
+
+int main( int argc, char *const argv[] )
+{
+	BenchOptions options;
+	CorpusShape shape;
+	std::string corpusDir;
+	bool generateOnly = false, badOption = false;
+	std::vector<std::string> inputs;
+	for ( int i = 1; i < argc and not badOption; ++i )
+	{
+		std::string arg = argv[i], value;
+		if ( not arg.empty() and arg[0] != '-' )
+			inputs.push_back( arg );
+		else if ( BenchOptionValue( argc, argv, i, "--min-time", value ) )
+			options.minTime = strtod( value.c_str(), nullptr );
+		else if ( BenchOptionValue( argc, argv, i, "--filter", value ) )
+			options.filter = value;
+		else if ( BenchOptionValue( argc, argv, i, "--corpus-dir", value ) )
+			corpusDir = value;
+		else if ( arg == "--generate" )
+			generateOnly = true;
+		else if ( BenchOptionValue( argc, argv, i, "--files", value ) )
+			shape.files = strtoul( value.c_str(), nullptr, 10 );
+		else if ( BenchOptionValue( argc, argv, i, "--objects", value ) )
+			shape.objects = strtoul( value.c_str(), nullptr, 10 );
+		else if ( BenchOptionValue( argc, argv, i, "--depth", value ) )
+			shape.depth = strtoul( value.c_str(), nullptr, 10 );
+		else if ( BenchOptionValue( argc, argv, i, "--stream-size", value ) )
+			shape.streamSize = strtoul( value.c_str(), nullptr, 10 );
+		else if ( BenchOptionValue( argc, argv, i, "--share", value ) )
+			shape.share = strtod( value.c_str(), nullptr );
+		else
+			badOption = true;
+	}
+	if ( badOption or shape.share < 0 or shape.share > 1 )
+	{
+		PrintBenchUsage( argv[0] );
+		return -1;
+	}
+
+	std::vector<CorpusFile> files;
+	bool generated = inputs.empty();
+	try
+	{
+		if ( generated )
+		{
+			if ( corpusDir.empty() )
+			{
+				const char *tmp = getenv( "TMPDIR" );
+				corpusDir = tmp != nullptr and *tmp != 0 ? tmp : "/tmp";
+			}
+			files = WriteCorpus( corpusDir, shape );
+		}
+		for ( auto &it : inputs )
+		{
+			struct stat st;
+			files.push_back( CorpusFile{
+				it, stat( it.c_str(), &st ) == 0 ? (uint64_t)st.st_size : 0,
+				TrailerObjectCount( it )} );
+		}
+		if ( generateOnly )
+		{
+			for ( auto &it : files )
+				std::cout << it.path << ": " << it.objects << " objects, "
+						  << it.size << " bytes" << std::endl;
+			return 0;
+		}
+
+		PrintHeader();
+		BenchEncoders( options );
+		BenchObjects( options );
+		BenchConversions( options, files );
+	}
+	catch ( std::exception &e )
+	{
+		std::cerr << e.what() << std::endl;
+		badOption = true;
+	}
+
+	if ( generated )
+	{
+		for ( auto &it : files )
+			std::remove( it.path.c_str() );
+	}
+	return badOption ? 1 : 0;
+}
@@ -1,894 +1,734 @@
-#include <ApplicationServices/ApplicationServices.h>
-#include <iomanip>
+// Command line of the converter: converts files to stdout or to a directory,
+// or serves conversion jobs on a socket.
+#include "pdf2text.h"
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <atomic>
+#include <fstream>
 #include <iostream>
-#include <map>
-#include <sstream>
-#include <stdexcept>
-#include <string>
-#include <unordered_map>
-#include <vector>
-
-class PDFBoolean;
-class PDFNumber;
-class PDFString;
-class PDFName;
-class PDFArray;
-class PDFDictionary;
-class PDFStream;
-class PDFNull;
-
-class PDFObject
-{
-public:
-	virtual ~PDFObject() = default;
-
-	enum type_t
-	{
-		type_invalid,
-
-		type_boolean,
-		type_number,
-		type_string,
-		type_name,
-		type_array,
-		type_dict,
-		type_stream,
-		type_null
-	};
-
-	type_t type() const { return _type; }
-
-	bool isBoolean() const { return type() == type_boolean; }
-	bool isNumber() const { return type() == type_number; }
-	bool isString() const { return type() == type_string; }
-	bool isName() const { return type() == type_name; }
-	bool isArray() const { return type() == type_array; }
-	bool isDictionary() const { return type() == type_dict; }
-	bool isStream() const { return type() == type_stream; }
-	bool isNull() const { return type() == type_null; }
-
-	const PDFNumber *asNumber() const
-	{
-		return isNumber() ? (const PDFNumber *)this : nullptr;
-	}
-	const PDFBoolean *asBoolean() const
-	{
-		return isBoolean() ? (const PDFBoolean *)this : nullptr;
-	}
-	const PDFString *asString() const
-	{
-		return isString() ? (const PDFString *)this : nullptr;
-	}
-	const PDFName *asName() const
-	{
-		return isName() ? (const PDFName *)this : nullptr;
-	}
-	const PDFArray *asArray() const
-	{
-		return isArray() ? (const PDFArray *)this : nullptr;
-	}
-	const PDFDictionary *asDictionary() const
-	{
-		return isDictionary() ? (const PDFDictionary *)this : nullptr;
-	}
-	const PDFStream *asStream() const
-	{
-		return isStream() ? (const PDFStream *)this : nullptr;
-	}
-	const PDFNull *asNull() const
-	{
-		return isNull() ? (const PDFNull *)this : nullptr;
-	}
-
-	void inc() { ++_refCount; }
-
-	bool indirect() const
-	{
-		return _refCount > 1 or isStream() or isDictionary();
-	}
-
-	void setID( int i ) { _id = i; }
-	int getID() const { return _id; }
-
-protected:
-	PDFObject( type_t i_type ) : _type( i_type ) {}
-
-	type_t _type;
-	size_t _refCount{1};
-	int _id{0};
-};
 
-class PDFBoolean : public PDFObject
+struct Options
 {
-public:
-	PDFBoolean( bool i_value ) : PDFObject( type_boolean ), _value( i_value ) {}
-
-	bool value() const { return _value; }
-
-protected:
-	bool _value;
+	size_t jobs{1};
+	std::string outDir;
+	bool directIO{false};
+	// write a manifest next to each output, and previous outputs to update
+	bool manifest{false};
+	std::string previousDir;
+	// a line of JSON stats per document, to stderr or appended to statsPath
+	bool stats{false};
+	std::string statsPath;
+	// Unix domain socket to serve conversion jobs on, instead of the files
+	std::string servePath;
+	SessionSettings session;
+	ConvertOptions save;
 };
 
-class PDFNumber : public PDFObject
+// the output of a file in --out-dir has the same name as the input
+std::string OutputPath( const std::string &i_dir, const std::string &i_path )
 {
-public:
-	PDFNumber( int i_value ) : PDFObject( type_number ), _isInt( true )
-	{
-		u._intValue = i_value;
-	}
-	PDFNumber( float i_value ) : PDFObject( type_number ), _isInt( false )
-	{
-		u._floatValue = i_value;
-	}
-
-	bool isInt() const { return _isInt; }
-	int intValue() const { return _isInt ? u._intValue : (int)u._floatValue; }
-	float floatValue() const
-	{
-		return _isInt ? (float)u._intValue : u._floatValue;
-	}
-
-protected:
-	bool _isInt;
-	union
-	{
-		int _intValue;
-		float _floatValue;
-	} u;
-};
+	if ( i_path == "-" )
+		return i_dir + "/stdin.pdf";
+	auto slash = i_path.find_last_of( '/' );
+	return i_dir + "/" +
+		   ( slash == std::string::npos ? i_path : i_path.substr( slash + 1 ) );
+}
 
-class PDFString : public PDFObject
+// Write a line of stats to stderr, or append it to i_path.  Failures are
+// reported once, they don't fail the conversions.
+void WriteStats( const std::string &i_line, const std::string &i_path )
 {
-public:
-	PDFString( const std::string &i_value )
-		: PDFObject( type_string ), _value( i_value )
+	static std::mutex statsMutex;
+	std::lock_guard<std::mutex> lock( statsMutex );
+	if ( i_path.empty() )
 	{
+		std::cerr << i_line << std::endl;
+		return;
 	}
-
-	const std::string &value() const { return _value; }
-
-protected:
-	std::string _value;
-};
-
-class PDFName : public PDFObject
-{
-public:
-	PDFName( const std::string &i_value )
-		: PDFObject( type_name ), _value( i_value )
+	static bool failed = false;
+	std::ofstream out( i_path, std::ios::app );
+	if ( not( out << i_line << std::endl ) and not failed )
 	{
+		failed = true;
+		std::cerr << "cannot write stats -> " << i_path << std::endl;
 	}
+}
 
-	const std::string &value() const { return _value; }
-
-protected:
-	std::string _value;
-};
-
-class PDFArray : public PDFObject
+// whether the paths are the same file
+bool SameFile( const std::string &i_a, const std::string &i_b )
 {
-public:
-	PDFArray() : PDFObject( type_array ) {}
-
-	size_t count() const { return _value.size(); }
-	const PDFObject *value( size_t i_index ) const { return _value[i_index]; }
-
-	void addValue( PDFObject *i_obj ) { _value.push_back( i_obj ); }
-
-protected:
-	std::vector<PDFObject *> _value;
-};
+	struct stat a, b;
+	return stat( i_a.c_str(), &a ) == 0 and stat( i_b.c_str(), &b ) == 0 and
+		   a.st_dev == b.st_dev and a.st_ino == b.st_ino;
+}
 
-class PDFDictionary : public PDFObject
+// Convert i_path to i_outPath, or to stdout when empty, and report its error
+// if any.  With o_stats, the stats are always made, and returned there
+// instead of written.  May be called from any thread.
+bool Convert( const Options &i_options, PDF2TextSession &session,
+			  const std::string &i_path, const std::string &i_outPath,
+			  std::string *o_stats )
 {
-public:
-	PDFDictionary() : PDFObject( type_dict ) {}
-
-	size_t count() const { return _order.size(); }
-	const PDFObject *value( size_t i_index, std::string &o_key ) const
-	{
-		if ( i_index > count() )
-			return 0;
-		o_key = _order[i_index];
-		return value( o_key );
-	}
-	const PDFObject *value( const std::string &i_key ) const
-	{
-		if ( _value.find( i_key ) != _value.end() )
-			return _value.find( i_key )->second;
+	ConvertOptions convert = i_options.save;
+	if ( not i_options.previousDir.empty() )
+		convert.previous = OutputPath( i_options.previousDir, i_path );
+	// updated in place, the new output is written aside and replaces the
+	// previous one at the end, which stays readable meanwhile
+	std::string writePath = i_outPath;
+	bool inPlace = not convert.previous.empty() and not i_outPath.empty() and
+				   SameFile( convert.previous, i_outPath );
+	if ( inPlace )
+		writePath = i_outPath + ".new";
+	if ( not i_outPath.empty() and
+		 ( i_options.manifest or not i_options.previousDir.empty() ) )
+		convert.manifest = writePath + ".manifest";
+
+	std::string stats;
+	std::string *statsLine =
+		i_options.stats or o_stats != nullptr ? &stats : nullptr;
+	try
+	{
+		auto input = ConvertInput::file( i_path );
+		if ( writePath.empty() )
+		{
+			FileSink out( STDOUT_FILENO, false );
+			session.convert( input, out, convert, statsLine );
+		}
 		else
-			return 0;
-	}
-
-	void addValue( const std::string &i_key, PDFObject *i_obj )
-	{
-		_value.insert( std::make_pair( i_key, i_obj ) );
-		_order.push_back( i_key );
+		{
+			auto out = FileSink::create( writePath, i_options.directIO );
+			session.convert( input, *out, convert, statsLine );
+		}
+		if ( inPlace )
+		{
+			// the new output never goes with the previous manifest
+			std::remove( ( i_outPath + ".manifest" ).c_str() );
+			if ( rename( writePath.c_str(), i_outPath.c_str() ) != 0 or
+				 ( not convert.manifest.empty() and
+				   rename( convert.manifest.c_str(),
+						   ( i_outPath + ".manifest" ).c_str() ) != 0 ) )
+				throw std::runtime_error( "cannot replace output" );
+		}
+		if ( o_stats != nullptr )
+			*o_stats = stats;
+		else if ( statsLine != nullptr )
+			WriteStats( stats, i_options.statsPath );
+		return true;
+	}
+	catch ( std::exception &ex )
+	{
+		// don't leave a truncated output behind
+		if ( not writePath.empty() )
+			std::remove( writePath.c_str() );
+		if ( not convert.manifest.empty() )
+			std::remove( convert.manifest.c_str() );
+
+		// not converted yet, like a file that can't be created
+		if ( statsLine != nullptr and stats.empty() )
+			stats = PDF2TextSession::errorStats( i_path, ex.what() );
+		if ( o_stats != nullptr )
+			*o_stats = stats;
+		else if ( statsLine != nullptr )
+			WriteStats( stats, i_options.statsPath );
+		static std::mutex errorMutex;
+		std::lock_guard<std::mutex> lock( errorMutex );
+		std::cerr << ex.what() << " -> " << i_path << std::endl;
+		return false;
 	}
+}
 
-protected:
-	std::map<std::string, PDFObject *> _value;
-	std::vector<std::string> _order;
-};
+// convert one file and report its error if any, may be called from any thread
+bool ConvertOne( const Options &i_options, PDF2TextSession &session,
+				 const std::string &i_path )
+{
+	std::string outPath;
+	if ( not i_options.outDir.empty() )
+		outPath = OutputPath( i_options.outDir, i_path );
+	return Convert( i_options, session, i_path, outPath, nullptr );
+}
 
-class PDFStream : public PDFObject
+// match "name value" or "name=value" at argv[io_i]
+bool OptionValue( int argc, char *const argv[], int &io_i,
+				  const std::string &i_name, std::string &o_value )
 {
-public:
-	PDFStream( std::unique_ptr<PDFDictionary> &&i_dict, CFDataRef i_data,
-			   CGPDFDataFormat i_format )
-		: PDFObject( type_stream ),
-		  _dict( std::move( i_dict ) ),
-		  _data( i_data ),
-		  _format( i_format )
+	std::string arg = argv[io_i];
+	if ( arg == i_name and io_i + 1 < argc )
 	{
-		CFRetain( _data );
+		o_value = argv[++io_i];
+		return true;
 	}
-
-	virtual ~PDFStream() { CFRelease( _data ); }
-
-	const PDFDictionary *dict() const { return _dict.get(); }
-	CFDataRef data( CGPDFDataFormat &o_format ) const
+	if ( arg.compare( 0, i_name.size() + 1, i_name + "=" ) == 0 )
 	{
-		o_format = _format;
-		return _data;
+		o_value = arg.substr( i_name.size() + 1 );
+		return true;
 	}
+	return false;
+}
 
-	mutable bool outputAsText{false};
-
-protected:
-	std::unique_ptr<PDFDictionary> _dict;
-	CFDataRef _data;
-	CGPDFDataFormat _format;
-};
-
-class PDFNull : public PDFObject
-{
-public:
-	PDFNull() : PDFObject( type_null ){};
-};
-
-typedef struct PDFIdentifier_dummy *PDFIdentifier;
-
-PDFIdentifier IDRef( CGPDFDictionaryRef obj )
+// page ranges like 3-5,7,10-
+bool ParsePages( const std::string &i_value,
+				 std::vector<std::pair<size_t, size_t>> &o_pages )
 {
-	return (PDFIdentifier)obj;
+	const char *p = i_value.c_str();
+	do
+	{
+		char *end;
+		size_t first = strtoul( p, &end, 10 ), last = first;
+		if ( end == p or first == 0 )
+			return false;
+		p = end;
+		if ( *p == '-' )
+		{
+			last = strtoul( ++p, &end, 10 );
+			if ( end == p )
+				last = SIZE_MAX;
+			else if ( last < first )
+				return false;
+			p = end;
+		}
+		o_pages.emplace_back( first, last );
+	} while ( *p++ == ',' );
+	return p[-1] == 0;
 }
 
-PDFIdentifier IDRef( CGPDFStreamRef obj )
+// page parts like contents,fonts
+bool ParseParts( const std::string &i_value, unsigned &o_parts )
 {
-	return (PDFIdentifier)obj;
+	static const std::pair<const char *, page_part_t> names[] = {
+		{"contents", part_contents},	 {"annots", part_annots},
+		{"fonts", part_fonts},			 {"images", part_images},
+		{"functions", part_functions},   {"colorspaces", part_colorspaces},
+		{"extgstates", part_extgstates}};
+	o_parts = 0;
+	size_t begin = 0;
+	do
+	{
+		size_t end = std::min( i_value.find( ',', begin ), i_value.size() );
+		auto part = i_value.substr( begin, end - begin );
+		auto it = std::find_if( std::begin( names ), std::end( names ),
+								[&part]( const std::pair<const char *,
+														 page_part_t> &i_name ) {
+									return part == i_name.first;
+								} );
+		if ( it == std::end( names ) )
+			return false;
+		o_parts |= it->second;
+		begin = end + 1;
+	} while ( begin <= i_value.size() );
+	return true;
 }
 
-PDFIdentifier IDRef( CGPDFArrayRef obj )
+// Parse the option at argv[io_i] and advance io_i past its arguments.  Returns
+// false for an unknown or invalid option.
+bool ParseOption( int argc, char *const argv[], int &io_i, Options &io_options )
 {
-	return (PDFIdentifier)obj;
+	std::string arg = argv[io_i], value;
+	if ( OptionValue( argc, argv, io_i, "-j", value ) )
+		io_options.jobs = strtoul( value.c_str(), nullptr, 10 );
+	else if ( arg.compare( 0, 2, "-j" ) == 0 and arg.size() > 2 )
+		io_options.jobs = strtoul( arg.c_str() + 2, nullptr, 10 );
+	else if ( OptionValue( argc, argv, io_i, "--out-dir", value ) )
+		io_options.outDir = value;
+	else if ( OptionValue( argc, argv, io_i, "--threads", value ) )
+		io_options.session.threads = strtoul( value.c_str(), nullptr, 10 );
+	else if ( arg == "--direct-io" )
+		io_options.directIO = true;
+	else if ( OptionValue( argc, argv, io_i, "--window", value ) )
+		io_options.save.window = strtoul( value.c_str(), nullptr, 10 );
+	else if ( OptionValue( argc, argv, io_i, "--encoding", value ) )
+	{
+		if ( value == "hex" )
+			io_options.save.encoding = encoding_hex;
+		else if ( value == "ascii85" )
+			io_options.save.encoding = encoding_ascii85;
+		else if ( value == "binary" )
+			io_options.save.encoding = encoding_none;
+		else
+			return false;
+	}
+	else if ( arg == "--flate" )
+		io_options.save.flate = true;
+	else if ( OptionValue( argc, argv, io_i, "--optimize", value ) )
+	{
+		if ( value == "size" )
+			io_options.save.optimize = optimize_size;
+		else if ( value == "speed" )
+			io_options.save.optimize = optimize_speed;
+		else if ( value == "editable" )
+			io_options.save.optimize = optimize_editable;
+		else
+			return false;
+	}
+	else if ( arg == "--dedupe" )
+		io_options.save.dedupe = true;
+	else if ( arg == "--dedupe=all" )
+		io_options.save.dedupe = io_options.save.dedupeContainers = true;
+	else if ( arg == "--inline" )
+		io_options.save.inlineObjects = true;
+	else if ( arg == "--object-streams" )
+		io_options.save.objectStreams = true;
+	else if ( arg == "--pretty" )
+		io_options.save.prettyContents = true;
+	else if ( arg == "--page-order" )
+		io_options.save.pageOrder = true;
+	else if ( OptionValue( argc, argv, io_i, "--cache-size", value ) )
+		io_options.session.cacheSize = strtoul( value.c_str(), nullptr, 10 ) << 20;
+	else if ( OptionValue( argc, argv, io_i, "--cache-dir", value ) )
+		io_options.session.cacheDir = value;
+	else if ( OptionValue( argc, argv, io_i, "--spill", value ) )
+		io_options.session.spillSize = strtoul( value.c_str(), nullptr, 10 ) << 20;
+	else if ( OptionValue( argc, argv, io_i, "--spill-dir", value ) )
+		io_options.session.spillDir = value;
+	else if ( arg == "--stats" )
+		io_options.stats = true;
+	else if ( arg.compare( 0, 8, "--stats=" ) == 0 )
+	{
+		io_options.stats = true;
+		io_options.statsPath = arg.substr( 8 );
+	}
+	else if ( OptionValue( argc, argv, io_i, "--serve", value ) )
+		io_options.servePath = value;
+	else if ( arg == "--manifest" )
+		io_options.manifest = true;
+	else if ( OptionValue( argc, argv, io_i, "--previous", value ) )
+		io_options.previousDir = value;
+	else if ( OptionValue( argc, argv, io_i, "--pages", value ) )
+		return ParsePages( value, io_options.save.pages );
+	else if ( OptionValue( argc, argv, io_i, "--only", value ) )
+		return ParseParts( value, io_options.save.parts );
+	else if ( OptionValue( argc, argv, io_i, "--max-objects", value ) )
+		io_options.save.maxObjects = strtoul( value.c_str(), nullptr, 10 );
+	else if ( OptionValue( argc, argv, io_i, "--max-depth", value ) )
+		io_options.save.maxDepth = strtoul( value.c_str(), nullptr, 10 );
+	else if ( OptionValue( argc, argv, io_i, "--max-stream", value ) )
+		io_options.save.maxStreamSize = strtoul( value.c_str(), nullptr, 10 ) << 20;
+	else if ( OptionValue( argc, argv, io_i, "--max-decoded", value ) )
+		io_options.save.maxDecodedSize = strtoul( value.c_str(), nullptr, 10 ) << 20;
+	else if ( OptionValue( argc, argv, io_i, "--timeout", value ) )
+		io_options.save.timeout = strtod( value.c_str(), nullptr );
+	else if ( arg.compare( 0, 8, "--flate=" ) == 0 )
+	{
+		char *end;
+		long level = strtol( arg.c_str() + 8, &end, 10 );
+		io_options.save.flate = true;
+		io_options.save.flateLevel = (int)level;
+		return *end == 0 and end != arg.c_str() + 8 and level >= 0 and
+			   level <= 9;
+	}
+	else
+		return false;
+	return true;
 }
 
-PDFIdentifier IDRef( CGPDFObjectRef obj )
+// whether i_arg is an option of the whole process, not of a document
+bool ProcessOption( const std::string &i_arg )
 {
-	switch ( CGPDFObjectGetType( obj ) )
+	if ( i_arg.compare( 0, 2, "-j" ) == 0 )
+		return true;
+	for ( auto name : {"--out-dir", "--threads", "--cache-size", "--cache-dir",
+					   "--spill", "--spill-dir", "--stats", "--serve"} )
 	{
-		case kCGPDFObjectTypeNull:
-		case kCGPDFObjectTypeBoolean:
-		case kCGPDFObjectTypeInteger:
-		case kCGPDFObjectTypeReal:
-		case kCGPDFObjectTypeName:
-		case kCGPDFObjectTypeString:
-			return (PDFIdentifier)obj;
-		case kCGPDFObjectTypeArray:
-		{
-			CGPDFArrayRef v;
-			bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeArray, &v );
-			assert( res );
-			return (PDFIdentifier)v;
-		}
-		case kCGPDFObjectTypeDictionary:
-		{
-			CGPDFDictionaryRef v;
-			bool res =
-				CGPDFObjectGetValue( obj, kCGPDFObjectTypeDictionary, &v );
-			assert( res );
-			return (PDFIdentifier)v;
-		}
-		case kCGPDFObjectTypeStream:
-		{
-			CGPDFStreamRef v;
-			bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeStream, &v );
-			assert( res );
-			return (PDFIdentifier)v;
-		}
-		default:
-			assert( false );
-			break;
+		size_t size = strlen( name );
+		if ( i_arg.compare( 0, size, name ) == 0 and
+			 ( i_arg.size() == size or i_arg[size] == '=' ) )
+			return true;
 	}
-	return 0;
+	return false;
 }
 
-struct Context
+void PrintUsage( const char *i_name )
 {
-	std::vector<std::unique_ptr<PDFObject>> objectList;
-	std::unordered_map<PDFIdentifier, PDFObject *> visited;
-};
-
-PDFObject *VisitDict( CGPDFDictionaryRef dict, Context &ctx );
-void VisitObject( CGPDFObjectRef obj, Context &ctx );
-void WriteObject( std::ostream &s, const PDFObject *obj );
+	std::cout << "usage: " << i_name << " [options] file [file...]\n"
+			  << "  a file named - is read from stdin\n"
+			  << "  -j N           convert N files in parallel (0: one per "
+				 "core), requires --out-dir\n"
+			  << "  --out-dir dir  write each output to dir instead of stdout\n"
+			  << "  --direct-io    bypass the page cache for the files in "
+				 "--out-dir\n"
+			  << "  --threads N    encode the streams of a document on N "
+				 "threads (0: one per core)\n"
+			  << "  --window N     with --threads, max number of streams "
+				 "encoded ahead of the writer\n"
+			  << "  --encoding=E   encoding of the binary streams: hex "
+				 "(default), ascii85 or binary\n"
+			  << "  --flate[=N]    compress the streams with FlateDecode, at "
+				 "level N from 0 to 9\n"
+			  << "  --optimize=P   choose the encoding and compression of "
+				 "each stream for P,\n"
+			  << "                 instead of --encoding and --flate:\n"
+			  << "                 size      smallest output, compressed "
+				 "when it pays off\n"
+			  << "                 speed     never compressed nor scanned, "
+				 "hex unless known text\n"
+			  << "                 editable  the text bodies as they are, "
+				 "the others in hex\n"
+			  << "  --dedupe[=all] write the streams with the same content "
+				 "only once, and with\n"
+			  << "                 all the dictionaries and arrays that "
+				 "aren't found by reference\n"
+			  << "  --inline       write the dictionaries used once in the "
+				 "object using them\n"
+			  << "  --object-streams\n"
+			  << "                 pack the objects in object streams, with "
+				 "an xref stream\n"
+			  << "  --pretty       write the page contents one operator per "
+				 "line\n"
+			  << "  --page-order   write the objects page by page, the output "
+				 "is flushed after each\n"
+			  << "  --cache-size N keep up to N MB of encoded streams to "
+				 "reuse across the files\n"
+			  << "  --cache-dir d  also keep the encoded streams in d, "
+				 "across runs\n"
+			  << "  --spill N      map the stream bodies of N MB or more "
+				 "from a temporary file\n"
+			  << "  --spill-dir d  directory of the --spill file, "
+				 "$TMPDIR by default\n"
+			  << "  --manifest     write the hash of each stream to "
+				 "output.manifest\n"
+			  << "  --previous d   copy the unchanged streams from the "
+				 "outputs in d and their manifest\n"
+			  << "  --stats[=F]    write a line of JSON with the timing and "
+				 "counters of each file\n"
+			  << "                 to stderr, or append it to F\n"
+			  << "  --serve s      serve conversion jobs on the Unix domain "
+				 "socket s\n"
+			  << "  --pages=R      convert only the pages in R, like "
+				 "3-5,7,10-\n"
+			  << "  --only=P       keep only the parts P of the pages, from "
+				 "contents,annots,\n"
+			  << "                 fonts,images,functions,colorspaces,"
+				 "extgstates\n"
+			  << "  --max-objects N\n"
+			  << "                 fail the documents with more than N "
+				 "objects\n"
+			  << "  --max-depth N  fail the documents with objects nested "
+				 "more than N deep\n"
+			  << "  --max-stream N fail the documents with a stream of more "
+				 "than N MB decoded\n"
+			  << "  --max-decoded N\n"
+			  << "                 fail the documents with more than N MB "
+				 "of decoded streams\n"
+			  << "  --timeout S    fail the documents not converted in S "
+				 "seconds\n"
+			  << std::endl;
+}
 
-void SavePDF( std::ostream &s, int majorVersion, int minorVersion,
-			  const std::vector<std::unique_ptr<PDFObject>> &objectList,
-			  PDFObject *i_root, PDFObject *i_info )
+// Conversion server on a Unix domain socket, with --serve.  It keeps
+// CoreGraphics loaded and the stream cache and arena blocks warm across the
+// jobs of its clients, run on -j threads.  A job is a line of arguments
+// separated by tabs:
+//
+//   input <TAB> output [<TAB> option...]
+//
+// where the options apply to that document; the ones of the process, like
+// -j, --threads, --cache-size or --spill, are only taken from the command
+// line and refused in a job.  "-" as input or output stands for the next file
+// descriptor the client sent with SCM_RIGHTS.  Each job is answered as it ends
+// by a line with its number on the connection, from 1, "ok" or "error", and
+// its stats:
+//
+//   1 <TAB> ok <TAB> {"file":...}
+class Server
 {
-	// set the ID of all object that will be written as indirect object
-	int i = 0;
-	for ( auto &it : objectList )
+public:
+	Server( const Options &i_options, PDF2TextSession &io_session )
+		: _options( i_options ), _session( io_session ),
+		  _jobs( i_options.jobs )
 	{
-		if ( it->indirect() )
-			it->setID( ++i );
 	}
 
-	// locate Contents
-	for ( auto &it : objectList )
+	// serve until accepting connections fails, false if it can't start
+	bool run( const std::string &i_path )
 	{
-		auto dict = it->asDictionary();
-		if ( dict != nullptr )
+		sockaddr_un address{};
+		address.sun_family = AF_UNIX;
+		if ( i_path.size() >= sizeof( address.sun_path ) )
 		{
-			auto obj = dict->value( "Type" );
-			if ( obj != nullptr )
-			{
-				auto type = obj->asName();
-				if ( type != nullptr )
-				{
-					if ( type->value() == "Page" )
-					{
-						obj = dict->value( "Contents" );
-						if ( obj != nullptr )
-						{
-							auto contents = obj->asStream();
-							if ( contents != nullptr )
-								contents->outputAsText = true;
-						}
-					}
-				}
-			}
-			continue;
+			std::cerr << "socket path too long -> " << i_path << std::endl;
+			return false;
 		}
-		auto stream = it->asStream();
-		if ( stream != nullptr )
+		memcpy( address.sun_path, i_path.c_str(), i_path.size() + 1 );
+
+		// the socket of a previous server, never another file
+		struct stat st;
+		if ( stat( i_path.c_str(), &st ) == 0 and S_ISSOCK( st.st_mode ) )
+			unlink( i_path.c_str() );
+		int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+		if ( fd == -1 or
+			 bind( fd, (const sockaddr *)&address, sizeof( address ) ) != 0 or
+			 listen( fd, SOMAXCONN ) != 0 )
 		{
-			auto dict = stream->dict();
-			auto obj = dict->value( "FunctionType" );
-			if ( obj != nullptr )
-			{
-				auto num = obj->asNumber();
-				if ( num != nullptr )
-				{
-					if ( num->intValue() == 4 )
-						stream->outputAsText = true;
-				}
-			}
-			continue;
+			std::cerr << "cannot listen -> " << i_path << std::endl;
+			if ( fd != -1 )
+				close( fd );
+			return false;
 		}
-	}
-
-	// header
-	auto start = s.tellp();
-	s << "%PDF-" << majorVersion << "." << minorVersion << std::endl;
-	s << "%..." << std::endl;
+		// a client leaving before its replies must not stop the server
+		signal( SIGPIPE, SIG_IGN );
 
-	// write all objects and build the xref
-	std::map<int, size_t> xref;
-	for ( auto &current : objectList )
-	{
-		if ( current->indirect() )
+		for ( ;; )
 		{
-			xref.insert(
-				std::make_pair( current->getID(), s.tellp() - start ) );
-			s << current->getID() << " 0 obj\n";
-			WriteObject( s, current.get() );
-			s << "\nendobj\n";
+			int connection = accept( fd, nullptr, nullptr );
+			if ( connection == -1 and
+				 ( errno == EINTR or errno == ECONNABORTED ) )
+				continue;
+			if ( connection == -1 )
+				break;
+			{
+				std::lock_guard<std::mutex> lock( _mutex );
+				++_connections;
+			}
+			std::thread( [this, connection] {
+				serve( connection );
+				std::lock_guard<std::mutex> lock( _mutex );
+				if ( --_connections == 0 )
+					_closed.notify_all();
+			} ).detach();
 		}
-	}
-
-	//	xref
-	auto startXref = s.tellp();
-	s << "xref\n";
-	s << "0 " << xref.size() << std::endl;
-	s << "0000000000 00000 n " << std::endl;
-	for ( i = 1; i < xref.size() + 1; ++i )
-		s << std::setfill( '0' ) << std::setw( 10 ) << xref[i] << " "
-		  << "00000 n " << std::endl;
-
-	// trailer
-	s << "trailer" << std::endl;
-	s << "<< /Size " << xref.size() << " /Root " << i_root->getID()
-	  << " 0 R /Info " << i_info->getID() << " 0 R>>" << std::endl;
-	s << "startxref" << std::endl;
-	s << startXref - start << std::endl;
-	s << "%%EOF" << std::endl;
-}
-
-std::string make_writable( const std::string &i_s )
-{
-	std::string n;
-	n.reserve( i_s.size() );
-	for ( auto it : i_s )
-	{
-		if ( it == ' ' )
-			n.append( "#20" );
-		else
-			n.append( 1, it );
-	}
-	return n;
-}
-
-struct ConvData
-{
-	size_t size;
-	std::unique_ptr<char[]> data;
-};
-ConvData convertData( CFDataRef data, bool doASCII )
-{
-	auto ptr = CFDataGetBytePtr( data );
-	auto l = CFDataGetLength( data );
-
-	ConvData cd;
-	if ( not doASCII )
-	{
-		cd.size = l;
-		cd.data.reset( new char[cd.size] );
-		memcpy( cd.data.get(), ptr, cd.size );
-		return cd;
-	}
-	std::ostringstream ostr;
-
-	for ( CFIndex i = 0; i < l; )
-	{
-		int a = ( ( ptr[i] & 0xF0 ) >> 4 );
-		int b = ptr[i] & 0x0F;
-
-		char c = a >= 10 ? 'A' + a - 10 : '0' + a;
-		ostr << c;
-		c = b >= 10 ? 'A' + b - 10 : '0' + b;
-		ostr << c;
-
-		++i;
-		if ( ( i % 40 ) == 0 )
-			ostr << "\n";
-	}
-	ostr << "\n";
-
-	auto s = ostr.str();
-	cd.size = s.size();
-	cd.data.reset( new char[cd.size] );
-	memcpy( cd.data.get(), s.data(), cd.size );
-	return cd;
-}
+		std::cerr << "cannot accept connections -> " << i_path << std::endl;
+		close( fd );
+		std::unique_lock<std::mutex> lock( _mutex );
+		_closed.wait( lock, [this] { return _connections == 0; } );
+		return false;
+	}
+
+private:
+	struct Connection
+	{
+		int fd;
+		// received and not taken by a job yet
+		std::deque<int> fds;
+		size_t jobCount{0};
+		// for the replies
+		std::mutex mutex;
+		std::condition_variable done;
+		size_t pending{0};
+	};
 
-void WriteObject( std::ostream &s, const PDFObject *obj )
-{
-	switch ( obj->type() )
+	// read the jobs of a connection until the client closes it
+	void serve( int i_fd )
 	{
-		case PDFObject::type_boolean:
-			if ( obj->asBoolean()->value() )
-				s << "true ";
-			else
-				s << "false ";
-			break;
-		case PDFObject::type_number:
-			if ( obj->asNumber()->isInt() )
-				s << obj->asNumber()->intValue();
-			else
-				s << obj->asNumber()->floatValue();
-			break;
-		case PDFObject::type_string:
-			s << "(" << obj->asString()->value() << ")";
-			break;
-		case PDFObject::type_name:
-			s << "/" << make_writable( obj->asName()->value() );
-			break;
-		case PDFObject::type_array:
-			s << "[ ";
-			for ( size_t i = 0; i < obj->asArray()->count(); ++i )
-			{
-				auto o = obj->asArray()->value( i );
-				if ( o->indirect() )
-					s << o->getID() << " 0 R ";
-				else
-				{
-					WriteObject( s, o );
-					s << " ";
-				}
-			}
-			s << "]";
-			break;
-		case PDFObject::type_dict:
+		Connection connection;
+		connection.fd = i_fd;
+		std::string lines;
+		for ( ;; )
 		{
-			auto dict = obj->asDictionary();
-			s << "<<\n";
-			for ( size_t i = 0; i < dict->count(); ++i )
+			char data[4096];
+			char control[CMSG_SPACE( 16 * sizeof( int ) )];
+			iovec iov{data, sizeof( data )};
+			msghdr message{};
+			message.msg_iov = &iov;
+			message.msg_iovlen = 1;
+			message.msg_control = control;
+			message.msg_controllen = sizeof( control );
+			ssize_t n = recvmsg( i_fd, &message, 0 );
+			if ( n == -1 and errno == EINTR )
+				continue;
+			if ( n <= 0 )
+				break;
+			for ( auto c = CMSG_FIRSTHDR( &message ); c != nullptr;
+				  c = CMSG_NXTHDR( &message, c ) )
 			{
-				std::string name;
-				auto o = dict->value( i, name );
-				s << "/" << name << " ";
-				if ( o->indirect() )
-					s << o->getID() << " 0 R\n";
-				else
+				if ( c->cmsg_level != SOL_SOCKET or c->cmsg_type != SCM_RIGHTS )
+					continue;
+				size_t count = ( c->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int );
+				for ( size_t i = 0; i < count; ++i )
 				{
-					WriteObject( s, o );
-					s << "\n";
+					int fd;
+					memcpy( &fd, CMSG_DATA( c ) + i * sizeof( int ),
+							sizeof( int ) );
+					connection.fds.push_back( fd );
 				}
 			}
-			s << ">>";
-			break;
-		}
-		case PDFObject::type_stream:
-		{
-			auto dict = obj->asStream()->dict();
-			s << "<<\n";
-			CGPDFDataFormat format;
-			auto data = obj->asStream()->data( format );
-
-			bool doASCII = true;
-			auto type = dict->value( "Type" );
-			if ( type != nullptr and type->type() == PDFObject::type_name and
-				 type->asName()->value() == "Metadata" )
-				doASCII = false;
-			else if ( obj->asStream()->outputAsText )
-				doASCII = false;
-
-			auto convData = convertData( data, doASCII );
-
-			if ( doASCII )
-			{
-				if ( format == CGPDFDataFormatJPEGEncoded )
-					s << "/Filter [/ASCIIHexDecode /DCTDecode]\n";
-				else if ( format == CGPDFDataFormatJPEG2000 )
-					s << "/Filter [/ASCIIHexDecode /JPXDecode]\n";
-				else
-					s << "/Filter /ASCIIHexDecode\n";
-			}
 
-			for ( size_t i = 0; i < dict->count(); ++i )
+			lines.append( data, n );
+			size_t begin = 0;
+			for ( size_t end; ( end = lines.find( '\n', begin ) ) !=
+							  std::string::npos;
+				  begin = end + 1 )
 			{
-				std::string name;
-				auto o = dict->value( i, name );
-				if ( name == "Filter" )
-				{
-					// skip
-				}
-				else if ( name == "Length" )
-				{
-					s << "/Length " << convData.size << "\n";
-				}
-				else
-				{
-					s << "/" << name << " ";
-					if ( o->indirect() )
-						s << o->getID() << " 0 R\n";
-					else
-					{
-						WriteObject( s, o );
-						s << "\n";
-					}
-				}
+				if ( end > begin )
+					submit( connection, lines.substr( begin, end - begin ) );
 			}
-			s << ">>\nstream\n";
-			s.write( convData.data.get(), convData.size );
-			s << "\nendstream";
-			break;
+			lines.erase( 0, begin );
 		}
-		case PDFObject::type_null:
-			s << "null";
-			break;
-		default:
-			assert( false );
-			break;
-	}
-}
 
-int main( int argc, char *const argv[] )
-{
-	if ( argc < 2 )
-	{
-		std::cout << "usage: " << argv[0] << "file [file...]" << std::endl;
-		return -1;
+		std::unique_lock<std::mutex> lock( connection.mutex );
+		connection.done.wait( lock,
+							  [&connection] { return connection.pending == 0; } );
+		for ( auto fd : connection.fds )
+			close( fd );
+		close( i_fd );
 	}
 
-	for ( int i = 1; i < argc; ++i )
+	void submit( Connection &io_connection, const std::string &i_line )
 	{
-		try
+		size_t job = ++io_connection.jobCount;
+		std::vector<std::string> args;
+		for ( size_t begin = 0;; )
 		{
-			auto url = CFURLCreateFromFileSystemRepresentation(
-				0, (const UInt8 *)argv[i], strlen( argv[i] ), false );
-			if ( url == 0 )
-				throw std::runtime_error( "error creating url" );
-			auto doc = CGPDFDocumentCreateWithURL( url );
-			CFRelease( url );
-			if ( doc == 0 )
-				throw std::runtime_error( "cannot open file" );
-
-			int majorVersion, minorVersion;
-			CGPDFDocumentGetVersion( doc, &majorVersion, &minorVersion );
-
-			auto catalog = CGPDFDocumentGetCatalog( doc );
-			auto info = CGPDFDocumentGetInfo( doc );
-
-			// visit the whole hierarchy
-			Context ctx;
-			auto rootObj = VisitDict( catalog, ctx );
-			auto infoObj = VisitDict( info, ctx );
-
-			ctx.visited.clear();
-			CGPDFDocumentRelease( doc );
-
-			SavePDF( std::cout, majorVersion, minorVersion, ctx.objectList,
-					 rootObj, infoObj );
+			size_t end = std::min( i_line.find( '\t', begin ), i_line.size() );
+			args.push_back( i_line.substr( begin, end - begin ) );
+			if ( end == i_line.size() )
+				break;
+			begin = end + 1;
 		}
-		catch ( std::exception &ex )
+
+		// the file descriptors of the job, closed when it ends
+		std::vector<int> fds;
+		auto takeFd = [&io_connection, &fds]( std::string &io_arg ) {
+			if ( io_arg != "-" )
+				return true;
+			if ( io_connection.fds.empty() )
+				return false;
+			fds.push_back( io_connection.fds.front() );
+			io_connection.fds.pop_front();
+			io_arg = "/dev/fd/" + std::to_string( fds.back() );
+			return true;
+		};
+
+		Options options = _options;
+		std::string error;
+		if ( args.size() < 2 )
+			error = "expected input and output";
+		else if ( not takeFd( args[0] ) or not takeFd( args[1] ) )
+			error = "missing file descriptor";
+		else
 		{
-			std::cerr << ex.what() << " -> " << argv[i] << std::endl;
+			std::vector<char *> argv;
+			for ( auto &it : args )
+				argv.push_back( &it[0] );
+			for ( int i = 2; i < (int)argv.size() and error.empty(); ++i )
+			{
+				if ( ProcessOption( args[i] ) or
+					 not ParseOption( (int)argv.size(), argv.data(), i,
+									  options ) )
+					error = "invalid option " + args[i];
+			}
 		}
-	}
-	return 0;
-}
-
-void dictVisitor( const char *key, CGPDFObjectRef value, void *info )
-{
-	std::vector<std::string> *keys = (std::vector<std::string> *)info;
-	keys->push_back( key );
-}
-
-PDFObject *VisitDict( CGPDFDictionaryRef dict, Context &ctx )
-{
-	auto visit = ctx.visited.find( IDRef( dict ) );
-	if ( visit != ctx.visited.end() )
-	{
-		visit->second->inc();
-		return visit->second;
-	}
-
-	std::vector<std::string> keys;
-	CGPDFDictionaryApplyFunction( dict, dictVisitor, &keys );
-
-	auto newDict = std::make_unique<PDFDictionary>();
-	auto ptr = newDict.get();
-	ctx.visited.insert( std::make_pair( IDRef( dict ), ptr ) );
-	ctx.objectList.push_back( std::move( newDict ) );
-
-	for ( auto &it : keys )
-	{
-		CGPDFObjectRef value;
-		if ( CGPDFDictionaryGetObject( dict, it.c_str(), &value ) )
+		if ( not error.empty() )
 		{
-			VisitObject( value, ctx );
-			auto found = ctx.visited.find( IDRef( value ) );
-			assert( found != ctx.visited.end() );
-			ptr->addValue( it, found->second );
+			for ( auto fd : fds )
+				close( fd );
+			reply( io_connection, job, false,
+				   PDF2TextSession::errorStats( args[0], error ) );
+			return;
 		}
-	}
-	return ptr;
-}
 
-void VisitStream( CGPDFStreamRef stream, Context &ctx )
-{
-	auto visit = ctx.visited.find( IDRef( stream ) );
-	if ( visit != ctx.visited.end() )
-	{
-		visit->second->inc();
-		return;
-	}
-
-	auto streamDict = CGPDFStreamGetDictionary( stream );
-
-	std::vector<std::string> keys;
-	CGPDFDictionaryApplyFunction( streamDict, dictVisitor, &keys );
-
-	auto newDict = std::make_unique<PDFDictionary>();
-
-	for ( auto &it : keys )
-	{
-		CGPDFObjectRef value;
-		if ( CGPDFDictionaryGetObject( streamDict, it.c_str(), &value ) )
 		{
-			VisitObject( value, ctx );
-			auto found = ctx.visited.find( IDRef( value ) );
-			assert( found != ctx.visited.end() );
-			newDict->addValue( it, found->second );
+			std::lock_guard<std::mutex> lock( io_connection.mutex );
+			++io_connection.pending;
 		}
-	}
-
-	CGPDFDataFormat format;
-	auto data = CGPDFStreamCopyData( stream, &format );
-	auto newStream =
-		std::make_unique<PDFStream>( std::move( newDict ), data, format );
-	CFRelease( data );
-	ctx.visited.insert( std::make_pair( IDRef( stream ), newStream.get() ) );
-	ctx.objectList.push_back( std::move( newStream ) );
-}
-
-void VisitArray( CGPDFArrayRef array, Context &ctx )
-{
-	auto visit = ctx.visited.find( IDRef( array ) );
-	if ( visit != ctx.visited.end() )
-	{
-		visit->second->inc();
-		return;
-	}
-
-	auto newArray = std::make_unique<PDFArray>();
-	auto ptr = newArray.get();
-	ctx.visited.insert( std::make_pair( IDRef( array ), ptr ) );
-	ctx.objectList.push_back( std::move( newArray ) );
-
-	for ( size_t i = 0; i < CGPDFArrayGetCount( array ); ++i )
-	{
-		CGPDFObjectRef value;
-		if ( CGPDFArrayGetObject( array, i, &value ) )
+		auto connection = &io_connection;
+		_jobs.post( [this, connection, job, fds, options, args] {
+			std::string stats;
+			bool ok = Convert( options, _session, args[0], args[1], &stats );
+			for ( auto fd : fds )
+				close( fd );
+			reply( *connection, job, ok, stats );
+			std::lock_guard<std::mutex> lock( connection->mutex );
+			if ( --connection->pending == 0 )
+				connection->done.notify_all();
+		} );
+	}
+
+	// write a reply, of no use once the client is gone
+	void reply( Connection &io_connection, size_t i_job, bool i_ok,
+				const std::string &i_stats )
+	{
+		std::string line = std::to_string( i_job ) +
+						   ( i_ok ? "\tok\t" : "\terror\t" ) + i_stats + "\n";
+		std::lock_guard<std::mutex> lock( io_connection.mutex );
+		for ( size_t done = 0; done < line.size(); )
 		{
-			VisitObject( value, ctx );
-			auto found = ctx.visited.find( IDRef( value ) );
-			assert( found != ctx.visited.end() );
-			ptr->addValue( found->second );
+			auto n = ::write( io_connection.fd, line.data() + done,
+							  line.size() - done );
+			if ( n == -1 and errno == EINTR )
+				continue;
+			if ( n <= 0 )
+				break;
+			done += n;
 		}
 	}
-}
 
-void VisitNull( CGPDFObjectRef obj, Context &ctx )
-{
-	auto visit = ctx.visited.find( IDRef( obj ) );
-	if ( visit != ctx.visited.end() )
-	{
-		visit->second->inc();
-		return;
-	}
-
-	auto newNull = std::make_unique<PDFNull>();
-	ctx.visited.insert( std::make_pair( IDRef( obj ), newNull.get() ) );
-	ctx.objectList.push_back( std::move( newNull ) );
-}
+	const Options &_options;
+	PDF2TextSession &_session;
+	WorkerPool _jobs;
+	std::mutex _mutex;
+	std::condition_variable _closed;
+	size_t _connections{0};
+};
 
-void VisitInteger( CGPDFObjectRef obj, Context &ctx )
+int main( int argc, char *const argv[] )
 {
-	auto visit = ctx.visited.find( IDRef( obj ) );
-	if ( visit != ctx.visited.end() )
-	{
-		visit->second->inc();
-		return;
+	Options options;
+	std::vector<std::string> files;
+	bool badOption = false;
+	for ( int i = 1; i < argc and not badOption; ++i )
+	{
+		std::string arg = argv[i];
+		if ( not files.empty() or arg.empty() or arg[0] != '-' or arg == "-" )
+			files.push_back( arg );
+		else if ( arg == "--" and i + 1 < argc )
+			files.push_back( argv[++i] );
+		else
+			badOption = not ParseOption( argc, argv, i, options );
 	}
+	if ( options.jobs == 0 )
+		options.jobs = std::max( 1u, std::thread::hardware_concurrency() );
 
-	CGPDFInteger v;
-	bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeInteger, &v );
-	assert( res );
-	auto newNumber = std::make_unique<PDFNumber>( (int)v );
-	ctx.visited.insert( std::make_pair( IDRef( obj ), newNumber.get() ) );
-	ctx.objectList.push_back( std::move( newNumber ) );
-}
-
-void VisitFloat( CGPDFObjectRef obj, Context &ctx )
-{
-	auto visit = ctx.visited.find( IDRef( obj ) );
-	if ( visit != ctx.visited.end() )
+	if ( badOption or
+		 ( options.servePath.empty() and
+		   ( files.empty() or ( ( options.jobs > 1 or options.manifest ) and
+								options.outDir.empty() ) ) ) )
 	{
-		visit->second->inc();
-		return;
+		PrintUsage( argv[0] );
+		return -1;
 	}
 
-	CGPDFReal v;
-	bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeReal, &v );
-	assert( res );
-	auto newNumber = std::make_unique<PDFNumber>( (float)v );
-	ctx.visited.insert( std::make_pair( IDRef( obj ), newNumber.get() ) );
-	ctx.objectList.push_back( std::move( newNumber ) );
-}
-
-void VisitName( CGPDFObjectRef obj, Context &ctx )
-{
-	auto visit = ctx.visited.find( IDRef( obj ) );
-	if ( visit != ctx.visited.end() )
+	// shared by all the documents
+	options.session.recycleArenas = not options.servePath.empty();
+	std::unique_ptr<PDF2TextSession> session;
+	try
 	{
-		visit->second->inc();
-		return;
+		session.reset( new PDF2TextSession( options.session ) );
 	}
-
-	const char *v;
-	bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeName, &v );
-	assert( res );
-	auto newName = std::make_unique<PDFName>( v );
-	ctx.visited.insert( std::make_pair( IDRef( obj ), newName.get() ) );
-	ctx.objectList.push_back( std::move( newName ) );
-}
-
-void VisitString( CGPDFObjectRef obj, Context &ctx )
-{
-	auto visit = ctx.visited.find( IDRef( obj ) );
-	if ( visit != ctx.visited.end() )
+	catch ( std::exception &e )
 	{
-		visit->second->inc();
-		return;
+		// only the spill file can fail, in $TMPDIR without --spill-dir
+		std::cerr << e.what() << " -> "
+				  << ( options.session.spillDir.empty()
+						   ? "$TMPDIR"
+						   : options.session.spillDir )
+				  << std::endl;
+		return -1;
 	}
 
-	CGPDFStringRef v;
-	bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeString, &v );
-	assert( res );
-	auto newString = std::make_unique<PDFString>( std::string(
-		(const char *)CGPDFStringGetBytePtr( v ), CGPDFStringGetLength( v ) ) );
-	ctx.visited.insert( std::make_pair( IDRef( obj ), newString.get() ) );
-	ctx.objectList.push_back( std::move( newString ) );
-}
-
-void VisitBoolean( CGPDFObjectRef obj, Context &ctx )
-{
-	auto visit = ctx.visited.find( IDRef( obj ) );
-	if ( visit != ctx.visited.end() )
+	if ( not options.servePath.empty() )
 	{
-		visit->second->inc();
-		return;
+		Server server( options, *session );
+		return server.run( options.servePath ) ? 0 : 1;
 	}
 
-	CGPDFBoolean b;
-	bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeBoolean, &b );
-	assert( res );
-	auto newBoolean = std::make_unique<PDFBoolean>( b );
-	ctx.visited.insert( std::make_pair( IDRef( obj ), newBoolean.get() ) );
-	ctx.objectList.push_back( std::move( newBoolean ) );
-}
-
-void VisitObject( CGPDFObjectRef obj, Context &ctx )
-{
-	auto visit = ctx.visited.find( IDRef( obj ) );
-	if ( visit != ctx.visited.end() )
+	std::atomic<size_t> failed{0};
+	if ( options.jobs == 1 )
 	{
-		visit->second->inc();
-		return;
+		for ( auto &it : files )
+			if ( not ConvertOne( options, *session, it ) )
+				++failed;
 	}
-
-	switch ( CGPDFObjectGetType( obj ) )
+	else
 	{
-		case kCGPDFObjectTypeNull:
-			VisitNull( obj, ctx );
-			break;
-		case kCGPDFObjectTypeBoolean:
-			VisitBoolean( obj, ctx );
-			break;
-		case kCGPDFObjectTypeInteger:
-			VisitInteger( obj, ctx );
-			break;
-		case kCGPDFObjectTypeReal:
-			VisitFloat( obj, ctx );
-			break;
-		case kCGPDFObjectTypeName:
-			VisitName( obj, ctx );
-			break;
-		case kCGPDFObjectTypeString:
-			VisitString( obj, ctx );
-			break;
-		case kCGPDFObjectTypeArray:
-		{
-			CGPDFArrayRef v;
-			bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeArray, &v );
-			assert( res );
-			VisitArray( v, ctx );
-			break;
-		}
-		case kCGPDFObjectTypeDictionary:
-		{
-			CGPDFDictionaryRef v;
-			bool res =
-				CGPDFObjectGetValue( obj, kCGPDFObjectTypeDictionary, &v );
-			assert( res );
-			VisitDict( v, ctx );
-			break;
-		}
-		case kCGPDFObjectTypeStream:
-		{
-			CGPDFStreamRef v;
-			bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeStream, &v );
-			assert( res );
-			VisitStream( v, ctx );
-			break;
-		}
-		default:
-			assert( false );
-			break;
+		WorkerPool pool( std::min( options.jobs, files.size() ) );
+		for ( auto &it : files )
+			pool.post( [&options, &it, &failed, &session] {
+				if ( not ConvertOne( options, *session, it ) )
+					++failed;
+			} );
+		pool.wait();
 	}
+	return failed == 0 ? 0 : 1;
 }
@@ -0,0 +1,5005 @@
+#include "pdf2text.h"
+
+#include <ApplicationServices/ApplicationServices.h>
+#include <CommonCrypto/CommonDigest.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <type_traits>
+#include <vector>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#define PDF2TEXT_HEX_X86 1
+#include <immintrin.h>
+#elif defined( __aarch64__ )
+#define PDF2TEXT_HEX_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Bump allocator owning the objects of a document.  All its memory is freed at
+// once when it is destroyed; only the objects allocated with make() that are
+// not trivially destructible get their destructor called.
+class Arena
+{
+public:
+	Arena() = default;
+	Arena( const Arena & ) = delete;
+	Arena &operator=( const Arena & ) = delete;
+
+	~Arena()
+	{
+		for ( auto it = _finalizers; it != nullptr; it = it->next )
+			it->destroy( it->object );
+		auto &recycled = recycledBlocks();
+		if ( recycled.max > 0 )
+		{
+			std::lock_guard<std::mutex> lock( recycled.mutex );
+			while ( not _blocks.empty() and
+					recycled.blocks.size() < recycled.max )
+			{
+				recycled.blocks.push_back( std::move( _blocks.back() ) );
+				_blocks.pop_back();
+			}
+		}
+	}
+
+	// Keep up to i_maxBlocks blocks of the destroyed arenas for the next ones,
+	// for a process converting documents one after the other.
+	static void recycle( size_t i_maxBlocks )
+	{
+		recycledBlocks().max = i_maxBlocks;
+	}
+
+	void *allocate( size_t i_size, size_t i_align )
+	{
+		// large blocks get their own allocation to not waste the current one
+		if ( i_size > kBlockSize / 4 )
+		{
+			_largeBlocks.emplace_back( new char[i_size] );
+			return _largeBlocks.back().get();
+		}
+
+		auto ptr = align( _current, i_align );
+		if ( ptr + i_size > _end )
+		{
+			_blocks.push_back( newBlock() );
+			_current = _blocks.back().get();
+			_end = _current + kBlockSize;
+			ptr = align( _current, i_align );
+		}
+		_current = ptr + i_size;
+		return ptr;
+	}
+
+	template <class T>
+	T *allocateArray( size_t i_count )
+	{
+		return (T *)allocate( sizeof( T ) * i_count, alignof( T ) );
+	}
+
+	template <class T, class... Args>
+	T *make( Args &&... i_args )
+	{
+		auto obj = new ( allocate( sizeof( T ), alignof( T ) ) )
+			T( std::forward<Args>( i_args )... );
+		if ( not std::is_trivially_destructible<T>::value )
+		{
+			auto finalizer = new ( allocate( sizeof( Finalizer ),
+											 alignof( Finalizer ) ) ) Finalizer;
+			finalizer->destroy = []( void *i_obj ) { ( (T *)i_obj )->~T(); };
+			finalizer->object = obj;
+			finalizer->next = _finalizers;
+			_finalizers = finalizer;
+		}
+		return obj;
+	}
+
+private:
+	static const size_t kBlockSize = 64 * 1024;
+
+	static char *align( char *i_ptr, size_t i_align )
+	{
+		return (char *)( ( (uintptr_t)i_ptr + i_align - 1 ) &
+						 ~( (uintptr_t)i_align - 1 ) );
+	}
+
+	struct Finalizer
+	{
+		void ( *destroy )( void * );
+		void *object;
+		Finalizer *next;
+	};
+
+	struct RecycledBlocks
+	{
+		std::atomic<size_t> max{0};
+		std::mutex mutex;
+		std::vector<std::unique_ptr<char[]>> blocks;
+	};
+	static RecycledBlocks &recycledBlocks()
+	{
+		static RecycledBlocks recycled;
+		return recycled;
+	}
+
+	static std::unique_ptr<char[]> newBlock()
+	{
+		auto &recycled = recycledBlocks();
+		if ( recycled.max > 0 )
+		{
+			std::lock_guard<std::mutex> lock( recycled.mutex );
+			if ( not recycled.blocks.empty() )
+			{
+				auto block = std::move( recycled.blocks.back() );
+				recycled.blocks.pop_back();
+				return block;
+			}
+		}
+		return std::unique_ptr<char[]>( new char[kBlockSize] );
+	}
+
+	// of kBlockSize bytes, and the larger ones
+	std::vector<std::unique_ptr<char[]>> _blocks;
+	std::vector<std::unique_ptr<char[]>> _largeBlocks;
+	char *_current{nullptr};
+	char *_end{nullptr};
+	Finalizer *_finalizers{nullptr};
+};
+
+// NUL terminated string stored in an Arena
+class ArenaString
+{
+public:
+	ArenaString() = default;
+	ArenaString( Arena &i_arena, const char *i_data, size_t i_size )
+		: _size( i_size )
+	{
+		auto data = i_arena.allocateArray<char>( i_size + 1 );
+		memcpy( data, i_data, i_size );
+		data[i_size] = 0;
+		_data = data;
+	}
+
+	const char *data() const { return _data; }
+	size_t size() const { return _size; }
+	const char *begin() const { return _data; }
+	const char *end() const { return _data + _size; }
+	std::string str() const { return std::string( _data, _size ); }
+
+	bool operator==( const char *i_s ) const
+	{
+		// names may contain a NUL, i_s can be shorter than them
+		return strlen( i_s ) == _size and memcmp( _data, i_s, _size ) == 0;
+	}
+	bool operator!=( const char *i_s ) const { return not( *this == i_s ); }
+
+private:
+	const char *_data{""};
+	size_t _size{0};
+};
+
+std::ostream &operator<<( std::ostream &s, const ArenaString &i_s )
+{
+	return s.write( i_s.data(), i_s.size() );
+}
+
+// growable array of trivially copyable values stored in an Arena
+template <class T>
+class ArenaVector
+{
+public:
+	ArenaVector( Arena &i_arena ) : _arena( &i_arena ) {}
+
+	size_t size() const { return _size; }
+	const T &operator[]( size_t i_index ) const { return _data[i_index]; }
+	T &operator[]( size_t i_index ) { return _data[i_index]; }
+	const T *begin() const { return _data; }
+	const T *end() const { return _data + _size; }
+
+	void reserve( size_t i_capacity )
+	{
+		if ( i_capacity <= _capacity )
+			return;
+		auto data = _arena->allocateArray<T>( i_capacity );
+		if ( _size > 0 )
+			memcpy( (void *)data, _data, sizeof( T ) * _size );
+		_data = data;
+		_capacity = i_capacity;
+	}
+
+	void push_back( const T &i_value )
+	{
+		if ( _size == _capacity )
+			reserve( std::max<size_t>( 4, 2 * _capacity ) );
+		_data[_size++] = i_value;
+	}
+
+private:
+	Arena *_arena;
+	T *_data{nullptr};
+	size_t _size{0};
+	size_t _capacity{0};
+};
+
+typedef uint32_t Symbol;
+
+// names used by the converter, interned first so their symbol is known
+enum known_symbol_t : Symbol
+{
+	sym_Annot,
+	sym_Annots,
+	sym_Catalog,
+	sym_ColorSpace,
+	sym_Contents,
+	sym_Count,
+	sym_CropBox,
+	sym_ExtGState,
+	sym_FT,
+	sym_Fields,
+	sym_Filter,
+	sym_First,
+	sym_Font,
+	sym_FunctionType,
+	sym_IRT,
+	sym_Kids,
+	sym_Last,
+	sym_Length,
+	sym_MediaBox,
+	sym_Metadata,
+	sym_Next,
+	sym_OCGs,
+	sym_Outlines,
+	sym_P,
+	sym_Page,
+	sym_Pages,
+	sym_Parent,
+	sym_Pattern,
+	sym_Pg,
+	sym_Popup,
+	sym_Prev,
+	sym_Resources,
+	sym_Rotate,
+	sym_Shading,
+	sym_Threads,
+	sym_Type,
+	sym_XObject,
+
+	sym_count
+};
+
+// Interned names of a document, each distinct name is stored only once and
+// is identified by its Symbol.
+class SymbolTable
+{
+public:
+	SymbolTable( Arena &i_arena ) : _arena( i_arena )
+	{
+		const char *known[sym_count] = {
+			"Annot", "Annots", "Catalog", "ColorSpace", "Contents", "Count",
+			"CropBox", "ExtGState", "FT", "Fields", "Filter", "First", "Font",
+			"FunctionType", "IRT", "Kids", "Last", "Length", "MediaBox",
+			"Metadata", "Next", "OCGs", "Outlines", "P", "Page", "Pages",
+			"Parent", "Pattern", "Pg", "Popup", "Prev", "Resources", "Rotate",
+			"Shading", "Threads", "Type", "XObject"};
+		for ( Symbol i = 0; i < sym_count; ++i )
+		{
+			auto sym = intern( known[i] );
+			assert( sym == i );
+			(void)sym;
+		}
+	}
+	SymbolTable( const SymbolTable & ) = delete;
+	SymbolTable &operator=( const SymbolTable & ) = delete;
+
+	size_t count() const { return _names.size(); }
+	const ArenaString &name( Symbol i_symbol ) const
+	{
+		return _names[i_symbol];
+	}
+
+	Symbol intern( const char *i_name )
+	{
+		size_t size = strlen( i_name );
+		if ( 2 * ( _names.size() + 1 ) > _slots.size() )
+			grow();
+
+		size_t mask = _slots.size() - 1;
+		for ( size_t i = hash( i_name, size ) & mask;; i = ( i + 1 ) & mask )
+		{
+			// slots hold the symbol + 1, 0 is a free slot
+			auto slot = _slots[i];
+			if ( slot == 0 )
+			{
+				_names.push_back( ArenaString( _arena, i_name, size ) );
+				_slots[i] = (Symbol)_names.size();
+				return _slots[i] - 1;
+			}
+			auto &name = _names[slot - 1];
+			if ( name.size() == size and
+				 memcmp( name.data(), i_name, size ) == 0 )
+				return slot - 1;
+		}
+	}
+
+private:
+	// FNV-1a
+	static size_t hash( const char *i_data, size_t i_size )
+	{
+		uint64_t h = 14695981039346656037ull;
+		for ( size_t i = 0; i < i_size; ++i )
+			h = ( h ^ (unsigned char)i_data[i] ) * 1099511628211ull;
+		return (size_t)h;
+	}
+
+	void grow()
+	{
+		std::vector<Symbol> slots( std::max<size_t>( 64, 2 * _slots.size() ),
+								   0 );
+		size_t mask = slots.size() - 1;
+		for ( Symbol sym = 0; sym < _names.size(); ++sym )
+		{
+			auto &name = _names[sym];
+			size_t i = hash( name.data(), name.size() ) & mask;
+			while ( slots[i] != 0 )
+				i = ( i + 1 ) & mask;
+			slots[i] = sym + 1;
+		}
+		_slots.swap( slots );
+	}
+
+	Arena &_arena;
+	std::vector<ArenaString> _names;
+	std::vector<Symbol> _slots;
+};
+
+// Limits of the conversion of a document, from its ConvertOptions.  The checks
+// throw as soon as one is exceeded, so a pathological document is aborted
+// instead of stalling its worker.  The clock is only read every
+// kClockInterval objects and once per decoded stream; CoreGraphics can't be
+// stopped while it decodes, a stream is checked once it is.
+class Budget
+{
+public:
+	static const size_t kClockInterval = 1024;
+
+	Budget( const ConvertOptions &i_options )
+		: _maxObjects( i_options.maxObjects ),
+		  _maxDepth( i_options.maxDepth ),
+		  _maxStreamSize( i_options.maxStreamSize ),
+		  _maxDecodedSize( i_options.maxDecodedSize ),
+		  _timeout( i_options.timeout > 0 ),
+		  _deadline(
+			  std::chrono::steady_clock::now() +
+			  std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				  std::chrono::duration<double>( i_options.timeout ) ) )
+	{
+	}
+
+	static bool unlimited( const ConvertOptions &i_options )
+	{
+		return i_options.maxObjects == 0 and i_options.maxDepth == 0 and
+			   i_options.maxStreamSize == 0 and
+			   i_options.maxDecodedSize == 0 and i_options.timeout <= 0;
+	}
+
+	// a new object is visited
+	void visit()
+	{
+		if ( ++_objects == _nextClock )
+		{
+			_nextClock += kClockInterval;
+			checkTime();
+		}
+		if ( _maxObjects > 0 and _objects > _maxObjects )
+			throw std::runtime_error( "too many objects" );
+	}
+
+	// before allocating a container of i_count elements, each visited later
+	void reserve( size_t i_count ) const
+	{
+		if ( _maxObjects > 0 and i_count > _maxObjects - _objects )
+			throw std::runtime_error( "too many objects" );
+	}
+
+	// containers nested i_depth deep are being visited
+	void nest( size_t i_depth ) const
+	{
+		if ( _maxDepth > 0 and i_depth > _maxDepth )
+			throw std::runtime_error( "objects nested too deeply" );
+	}
+
+	// a stream was decoded to i_size bytes, from any thread
+	void decoded( size_t i_size )
+	{
+		if ( _maxStreamSize > 0 and i_size > _maxStreamSize )
+			throw std::runtime_error( "decoded stream too large" );
+		if ( _maxDecodedSize > 0 and
+			 ( _decoded += i_size ) > _maxDecodedSize )
+			throw std::runtime_error( "too much decoded data" );
+		checkTime();
+	}
+
+	void checkTime() const
+	{
+		if ( _timeout and std::chrono::steady_clock::now() > _deadline )
+			throw std::runtime_error( "conversion timed out" );
+	}
+
+private:
+	const size_t _maxObjects, _maxDepth, _maxStreamSize, _maxDecodedSize;
+	const bool _timeout;
+	const std::chrono::steady_clock::time_point _deadline;
+	// only the visit counts objects, on the thread of the conversion
+	size_t _objects{0};
+	size_t _nextClock{kClockInterval};
+	std::atomic<size_t> _decoded{0};
+};
+
+class PDFBoolean;
+class PDFNumber;
+class PDFString;
+class PDFName;
+class PDFArray;
+class PDFDictionary;
+class PDFStream;
+class PDFNull;
+
+// The objects are allocated in the Arena of their Context and never deleted
+// individually.
+class PDFObject
+{
+public:
+	enum type_t
+	{
+		type_invalid,
+
+		type_boolean,
+		type_number,
+		type_string,
+		type_name,
+		type_array,
+		type_dict,
+		type_stream,
+		type_null
+	};
+
+	type_t type() const { return _type; }
+
+	bool isBoolean() const { return type() == type_boolean; }
+	bool isNumber() const { return type() == type_number; }
+	bool isString() const { return type() == type_string; }
+	bool isName() const { return type() == type_name; }
+	bool isArray() const { return type() == type_array; }
+	bool isDictionary() const { return type() == type_dict; }
+	bool isStream() const { return type() == type_stream; }
+	bool isNull() const { return type() == type_null; }
+
+	const PDFNumber *asNumber() const
+	{
+		return isNumber() ? (const PDFNumber *)this : nullptr;
+	}
+	const PDFBoolean *asBoolean() const
+	{
+		return isBoolean() ? (const PDFBoolean *)this : nullptr;
+	}
+	const PDFString *asString() const
+	{
+		return isString() ? (const PDFString *)this : nullptr;
+	}
+	const PDFName *asName() const
+	{
+		return isName() ? (const PDFName *)this : nullptr;
+	}
+	const PDFArray *asArray() const
+	{
+		return isArray() ? (const PDFArray *)this : nullptr;
+	}
+	const PDFDictionary *asDictionary() const
+	{
+		return isDictionary() ? (const PDFDictionary *)this : nullptr;
+	}
+	const PDFStream *asStream() const
+	{
+		return isStream() ? (const PDFStream *)this : nullptr;
+	}
+	const PDFNull *asNull() const
+	{
+		return isNull() ? (const PDFNull *)this : nullptr;
+	}
+	PDFArray *asArray() { return isArray() ? (PDFArray *)this : nullptr; }
+	PDFDictionary *asDictionary()
+	{
+		return isDictionary() ? (PDFDictionary *)this : nullptr;
+	}
+	PDFStream *asStream() { return isStream() ? (PDFStream *)this : nullptr; }
+
+	void inc() { ++_refCount; }
+	size_t refCount() const { return _refCount; }
+	void setRefCount( size_t i_count ) { _refCount = i_count; }
+
+	bool indirect() const
+	{
+		return not _inlined and
+			   ( _refCount > 1 or isStream() or isDictionary() );
+	}
+	// written in the object referring to it, for a dictionary used once
+	void setInlined() { _inlined = true; }
+
+	void setID( int i ) { _id = i; }
+	int getID() const { return _id; }
+
+protected:
+	PDFObject( type_t i_type ) : _type( i_type ) {}
+	~PDFObject() = default;
+
+	type_t _type;
+	bool _inlined{false};
+	size_t _refCount{1};
+	int _id{0};
+};
+
+class PDFBoolean : public PDFObject
+{
+public:
+	PDFBoolean( bool i_value ) : PDFObject( type_boolean ), _value( i_value ) {}
+
+	bool value() const { return _value; }
+
+protected:
+	bool _value;
+};
+
+class PDFNumber : public PDFObject
+{
+public:
+	PDFNumber( int i_value ) : PDFObject( type_number ), _isInt( true )
+	{
+		u._intValue = i_value;
+	}
+	PDFNumber( double i_value ) : PDFObject( type_number ), _isInt( false )
+	{
+		u._realValue = i_value;
+	}
+
+	bool isInt() const { return _isInt; }
+	int intValue() const { return _isInt ? u._intValue : (int)u._realValue; }
+	double realValue() const
+	{
+		return _isInt ? (double)u._intValue : u._realValue;
+	}
+
+protected:
+	bool _isInt;
+	union
+	{
+		int _intValue;
+		double _realValue;
+	} u;
+};
+
+class PDFString : public PDFObject
+{
+public:
+	PDFString( Arena &i_arena, const char *i_value, size_t i_size )
+		: PDFObject( type_string ), _value( i_arena, i_value, i_size )
+	{
+	}
+
+	const ArenaString &value() const { return _value; }
+
+protected:
+	ArenaString _value;
+};
+
+class PDFName : public PDFObject
+{
+public:
+	PDFName( const SymbolTable &i_symbols, Symbol i_symbol )
+		: PDFObject( type_name ),
+		  _symbol( i_symbol ),
+		  _value( i_symbols.name( i_symbol ) )
+	{
+	}
+
+	Symbol symbol() const { return _symbol; }
+	const ArenaString &value() const { return _value; }
+
+protected:
+	Symbol _symbol;
+	ArenaString _value;
+};
+
+class PDFArray : public PDFObject
+{
+public:
+	PDFArray( Arena &i_arena, size_t i_capacity )
+		: PDFObject( type_array ), _value( i_arena )
+	{
+		_value.reserve( i_capacity );
+	}
+
+	size_t count() const { return _value.size(); }
+	const PDFObject *value( size_t i_index ) const { return _value[i_index]; }
+	PDFObject *valueAt( size_t i_index ) { return _value[i_index]; }
+
+	void addValue( PDFObject *i_obj ) { _value.push_back( i_obj ); }
+	void setValue( size_t i_index, PDFObject *i_obj )
+	{
+		_value[i_index] = i_obj;
+	}
+
+protected:
+	ArenaVector<PDFObject *> _value;
+};
+
+// The entries are kept in insertion order in a flat array.  Dictionaries are
+// small and keys are symbols, so lookup is a linear search on integers.
+class PDFDictionary : public PDFObject
+{
+public:
+	PDFDictionary( Arena &i_arena, const SymbolTable &i_symbols,
+				   size_t i_capacity )
+		: PDFObject( type_dict ), _symbols( &i_symbols ), _value( i_arena )
+	{
+		_value.reserve( i_capacity );
+	}
+
+	size_t count() const { return _value.size(); }
+	Symbol key( size_t i_index ) const { return _value[i_index].key; }
+	const PDFObject *value( size_t i_index, ArenaString &o_key ) const
+	{
+		if ( i_index >= count() )
+			return 0;
+		o_key = _symbols->name( _value[i_index].key );
+		return _value[i_index].value;
+	}
+	const PDFObject *value( Symbol i_key ) const
+	{
+		for ( auto &it : _value )
+		{
+			if ( it.key == i_key )
+				return it.value;
+		}
+		return 0;
+	}
+
+	PDFObject *valueAt( size_t i_index ) { return _value[i_index].value; }
+
+	void addValue( Symbol i_key, PDFObject *i_obj )
+	{
+		_value.push_back( Entry{i_key, i_obj} );
+	}
+	void setValue( size_t i_index, PDFObject *i_obj )
+	{
+		_value[i_index].value = i_obj;
+	}
+
+protected:
+	struct Entry
+	{
+		Symbol key;
+		PDFObject *value;
+	};
+
+	const SymbolTable *_symbols;
+	ArenaVector<Entry> _value;
+};
+
+class PDFStream : public PDFObject
+{
+public:
+	// the stream data is only decoded when needed, the document is retained
+	// so i_stream stays valid as long as this object.  The first decoding is
+	// charged to i_budget, which can be null, the same data decoded again for
+	// the deduplication or the output is not.
+	PDFStream( PDFDictionary *i_dict, CGPDFDocumentRef i_document,
+			   CGPDFStreamRef i_stream, Budget *i_budget )
+		: PDFObject( type_stream ),
+		  _dict( i_dict ),
+		  _document( CGPDFDocumentRetain( i_document ) ),
+		  _stream( i_stream ),
+		  _budget( i_budget )
+	{
+	}
+
+	~PDFStream() { CGPDFDocumentRelease( _document ); }
+
+	const PDFDictionary *dict() const { return _dict; }
+	PDFDictionary *dict() { return _dict; }
+
+	// decode the stream data, the caller must release it
+	CFDataRef copyData( CGPDFDataFormat &o_format ) const
+	{
+		auto data = CGPDFStreamCopyData( _stream, &o_format );
+		if ( data == 0 )
+			throw std::runtime_error( "cannot decode stream" );
+		if ( _budget != nullptr and not _charged.exchange( true ) )
+		{
+			try
+			{
+				_budget->decoded( CFDataGetLength( data ) );
+			}
+			catch ( ... )
+			{
+				CFRelease( data );
+				throw;
+			}
+		}
+		return data;
+	}
+
+	mutable bool outputAsText{false};
+	// a page content stream
+	mutable bool contents{false};
+
+protected:
+	PDFDictionary *_dict;
+	CGPDFDocumentRef _document;
+	CGPDFStreamRef _stream;
+	Budget *_budget;
+	// decodings can run on several threads
+	mutable std::atomic<bool> _charged{false};
+};
+
+class PDFNull : public PDFObject
+{
+public:
+	PDFNull() : PDFObject( type_null ){};
+};
+
+typedef struct PDFIdentifier_dummy *PDFIdentifier;
+
+PDFIdentifier IDRef( CGPDFDictionaryRef obj )
+{
+	return (PDFIdentifier)obj;
+}
+
+PDFIdentifier IDRef( CGPDFStreamRef obj )
+{
+	return (PDFIdentifier)obj;
+}
+
+PDFIdentifier IDRef( CGPDFArrayRef obj )
+{
+	return (PDFIdentifier)obj;
+}
+
+PDFIdentifier IDRef( CGPDFObjectRef obj )
+{
+	switch ( CGPDFObjectGetType( obj ) )
+	{
+		case kCGPDFObjectTypeNull:
+		case kCGPDFObjectTypeBoolean:
+		case kCGPDFObjectTypeInteger:
+		case kCGPDFObjectTypeReal:
+		case kCGPDFObjectTypeName:
+		case kCGPDFObjectTypeString:
+			return (PDFIdentifier)obj;
+		case kCGPDFObjectTypeArray:
+		{
+			CGPDFArrayRef v;
+			bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeArray, &v );
+			assert( res );
+			return (PDFIdentifier)v;
+		}
+		case kCGPDFObjectTypeDictionary:
+		{
+			CGPDFDictionaryRef v;
+			bool res =
+				CGPDFObjectGetValue( obj, kCGPDFObjectTypeDictionary, &v );
+			assert( res );
+			return (PDFIdentifier)v;
+		}
+		case kCGPDFObjectTypeStream:
+		{
+			CGPDFStreamRef v;
+			bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeStream, &v );
+			assert( res );
+			return (PDFIdentifier)v;
+		}
+		default:
+			assert( false );
+			break;
+	}
+	return 0;
+}
+
+// Open addressing hash map from CoreGraphics objects to the PDFObject created
+// for them.  Keys are pointers, so a multiplicative hash spreads them well.
+class VisitedMap
+{
+public:
+	size_t size() const { return _size; }
+	// calls to findOrInsert() and the ones that found their key
+	size_t lookups() const { return _lookups; }
+	size_t hits() const { return _hits; }
+
+	void reserve( size_t i_count )
+	{
+		// keep the load factor under 1/2
+		size_t capacity = 16;
+		while ( capacity < 2 * i_count )
+			capacity *= 2;
+		if ( capacity > _slots.size() )
+			rehash( capacity );
+	}
+
+	// Returns the slot of i_key, a new slot holds nullptr and must be set
+	// before any other insertion.
+	PDFObject *&findOrInsert( PDFIdentifier i_key )
+	{
+		if ( 2 * ( _size + 1 ) > _slots.size() )
+			rehash( std::max<size_t>( 16, 2 * _slots.size() ) );
+		++_lookups;
+		size_t mask = _slots.size() - 1;
+		for ( size_t i = hash( i_key ); ; i = ( i + 1 ) & mask )
+		{
+			auto &slot = _slots[i];
+			if ( slot.key == i_key )
+			{
+				++_hits;
+				return slot.value;
+			}
+			if ( slot.key == nullptr )
+			{
+				++_size;
+				slot.key = i_key;
+				return slot.value;
+			}
+		}
+	}
+
+	void clear()
+	{
+		std::vector<Slot>().swap( _slots );
+		_size = 0;
+		_shift = 64;
+	}
+
+private:
+	struct Slot
+	{
+		PDFIdentifier key;
+		PDFObject *value;
+	};
+
+	size_t hash( PDFIdentifier i_key ) const
+	{
+		return (size_t)( ( (uint64_t)(uintptr_t)i_key *
+						   0x9E3779B97F4A7C15ull ) >>
+						 _shift );
+	}
+
+	void rehash( size_t i_capacity )
+	{
+		std::vector<Slot> slots( i_capacity, Slot{nullptr, nullptr} );
+		slots.swap( _slots );
+		_shift = 64;
+		for ( size_t c = i_capacity; c > 1; c /= 2 )
+			--_shift;
+		size_t mask = i_capacity - 1;
+		for ( auto &it : slots )
+		{
+			if ( it.key == nullptr )
+				continue;
+			size_t i = hash( it.key );
+			while ( _slots[i].key != nullptr )
+				i = ( i + 1 ) & mask;
+			_slots[i] = it;
+		}
+	}
+
+	std::vector<Slot> _slots;
+	size_t _size{0};
+	unsigned _shift{64};
+	size_t _lookups{0}, _hits{0};
+};
+
+// entries of the dictionaries skipped in a selective conversion
+enum visit_filter_t : uint8_t
+{
+	filter_none,
+	// page tree nodes
+	filter_page,
+	// resources of the page tree nodes
+	filter_resources,
+
+	filter_count
+};
+
+// dictionary, array or stream whose elements are being visited
+struct VisitFrame
+{
+	CGPDFDictionaryRef dict;
+	CGPDFArrayRef array;
+	PDFDictionary *newDict;
+	PDFArray *newArray;
+	// added to objectList once its dictionary is visited
+	PDFStream *newStream;
+	// next and end index of the elements, for dictionaries in visitKeys
+	size_t next, end;
+	size_t keyBegin;
+	visit_filter_t filter;
+};
+
+struct Context
+{
+	CGPDFDocumentRef document{nullptr};
+	// owns the objects, everything is released with the context
+	Arena arena;
+	SymbolTable symbols{arena};
+	std::vector<PDFObject *> objectList;
+	VisitedMap visited;
+	// explicit stack of the object graph walk
+	std::vector<VisitFrame> visitStack;
+	std::vector<const char *> visitKeys;
+	// with a selection, the known keys skipped for each filter
+	bool selective{false};
+	bool skipped[filter_count][sym_count]{};
+	// limits of the walk, can be null
+	Budget *budget{nullptr};
+};
+
+const size_t OutputSink::kBlockAlignment;
+
+OutputSink &operator<<( OutputSink &s, char i_c )
+{
+	s.put( i_c );
+	return s;
+}
+
+OutputSink &operator<<( OutputSink &s, const char *i_s )
+{
+	s.write( i_s, strlen( i_s ) );
+	return s;
+}
+
+OutputSink &operator<<( OutputSink &s, const std::string &i_s )
+{
+	s.write( i_s.data(), i_s.size() );
+	return s;
+}
+
+OutputSink &operator<<( OutputSink &s, const ArenaString &i_s )
+{
+	s.write( i_s.data(), i_s.size() );
+	return s;
+}
+
+// Number formatting for the output, independent of the locale.
+
+struct DigitPairs
+{
+	DigitPairs()
+	{
+		for ( int i = 0; i < 100; ++i )
+		{
+			pairs[2 * i] = '0' + i / 10;
+			pairs[2 * i + 1] = '0' + i % 10;
+		}
+	}
+
+	char pairs[200];
+};
+const DigitPairs kDigitPairs;
+
+// write the digits of i_value before o_end, returns the first one
+char *formatUnsigned( uint64_t i_value, char *o_end )
+{
+	while ( i_value >= 100 )
+	{
+		o_end -= 2;
+		memcpy( o_end, kDigitPairs.pairs + 2 * ( i_value % 100 ), 2 );
+		i_value /= 100;
+	}
+	if ( i_value >= 10 )
+	{
+		o_end -= 2;
+		memcpy( o_end, kDigitPairs.pairs + 2 * i_value, 2 );
+	}
+	else
+		*--o_end = '0' + (char)i_value;
+	return o_end;
+}
+
+// enough for any double in fixed notation
+const size_t kRealBufferSize = 400;
+
+// Write i_digits as a number with i_point digits before the decimal point,
+// removing the trailing zeros of the fraction.
+char *formatFixed( const char *i_digits, size_t i_count, long i_point,
+				   bool i_negative, char *o_dst )
+{
+	while ( i_count > 0 and i_digits[i_count - 1] == '0' and
+			(long)i_count > i_point )
+		--i_count;
+	if ( i_negative and i_count > 0 )
+		*o_dst++ = '-';
+	if ( i_point <= 0 )
+	{
+		*o_dst++ = '0';
+		if ( i_count == 0 )
+			return o_dst;
+		*o_dst++ = '.';
+		o_dst = std::fill_n( o_dst, -i_point, '0' );
+		return std::copy( i_digits, i_digits + i_count, o_dst );
+	}
+	if ( (size_t)i_point >= i_count )
+	{
+		o_dst = std::copy( i_digits, i_digits + i_count, o_dst );
+		return std::fill_n( o_dst, i_point - i_count, '0' );
+	}
+	o_dst = std::copy( i_digits, i_digits + i_point, o_dst );
+	*o_dst++ = '.';
+	return std::copy( i_digits + i_point, i_digits + i_count, o_dst );
+}
+
+// Shortest decimal that reads back as i_value, in fixed notation as PDF has
+// no exponent.  o_dst must hold kRealBufferSize characters, returns the end.
+char *formatReal( double i_value, char *o_dst )
+{
+	if ( not std::isfinite( i_value ) )
+	{
+		*o_dst++ = '0';
+		return o_dst;
+	}
+	double a = std::fabs( i_value );
+	bool negative = i_value < 0;
+
+	// Fast path for the usual values that have a few decimals: find the
+	// smallest scale for which the value is an exact integer.  Both the
+	// integer and the power of ten are exact, the division rounds like
+	// parsing "r.ddd" would.
+	static const double kPow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+									1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+									1e12, 1e13, 1e14, 1e15, 1e16, 1e17};
+	for ( long d = 0; d < 18; ++d )
+	{
+		double scaled = a * kPow10[d];
+		if ( scaled >= 9007199254740992.0 )
+			break;
+		double r = std::floor( scaled + 0.5 );
+		if ( r / kPow10[d] == a )
+		{
+			char digits[24];
+			char *end = digits + sizeof( digits );
+			char *first = formatUnsigned( (uint64_t)r, end );
+			long count = end - first;
+			return formatFixed( first, count, count - d, negative, o_dst );
+		}
+	}
+
+	// general case, find the shortest precision that round trips
+	char buffer[32];
+	for ( int precision = 0; precision < 17; ++precision )
+	{
+		snprintf( buffer, sizeof( buffer ), "%.*e", precision, a );
+		if ( strtod( buffer, nullptr ) == a )
+			break;
+	}
+	// buffer is d.ddde[+-]x
+	char digits[24];
+	size_t count = 0;
+	const char *p = buffer;
+	for ( ; *p != 'e'; ++p )
+	{
+		if ( *p != '.' )
+			digits[count++] = *p;
+	}
+	long exponent = strtol( p + 1, nullptr, 10 );
+	return formatFixed( digits, count, exponent + 1, negative, o_dst );
+}
+
+template <class T>
+typename std::enable_if<std::is_integral<T>::value, OutputSink &>::type
+operator<<( OutputSink &s, T i_value )
+{
+	char buffer[24];
+	char *end = buffer + sizeof( buffer );
+	bool negative = i_value < 0;
+	auto v = negative ? 0 - (typename std::make_unsigned<T>::type)i_value
+					  : (typename std::make_unsigned<T>::type)i_value;
+	char *p = formatUnsigned( v, end );
+	if ( negative )
+		*--p = '-';
+	s.write( p, end - p );
+	return s;
+}
+
+OutputSink &operator<<( OutputSink &s, double i_value )
+{
+	char buffer[kRealBufferSize];
+	s.write( buffer, formatReal( i_value, buffer ) - buffer );
+	return s;
+}
+
+class StreamCache;
+class SpillFile;
+class Incremental;
+
+// peak resident memory of the process in bytes
+size_t PeakRSS()
+{
+	struct rusage usage;
+	if ( getrusage( RUSAGE_SELF, &usage ) != 0 )
+		return 0;
+#if defined( __APPLE__ )
+	return usage.ru_maxrss;
+#else
+	return usage.ru_maxrss * size_t( 1024 );
+#endif
+}
+
+// Operators of the content streams, sorted, counted in the stats of the
+// printed streams.  The other ones are counted at kContentOperatorCount.
+const char *const kContentOperators[] = {
+	"\"", "'", "B", "B*", "BDC", "BI", "BMC", "BT", "BX", "CS", "DP", "Do",
+	"EI", "EMC", "ET", "EX", "F", "G", "ID", "J", "K", "M", "MP", "Q", "RG",
+	"S", "SC", "SCN", "T*", "TD", "TJ", "TL", "Tc", "Td", "Tf", "Tj", "Tm",
+	"Tr", "Ts", "Tw", "Tz", "W", "W*", "b", "b*", "c", "cm", "cs", "d", "d0",
+	"d1", "f", "f*", "g", "gs", "h", "i", "j", "k", "l", "m", "n", "q", "re",
+	"rg", "ri", "s", "sc", "scn", "sh", "v", "w", "y"};
+const size_t kContentOperatorCount =
+	sizeof( kContentOperators ) / sizeof( kContentOperators[0] );
+
+// index of an operator in kContentOperators, kContentOperatorCount if unknown
+size_t ContentOperator( const char *i_name, size_t i_size )
+{
+	auto less = []( const char *i_a, size_t i_aSize, const char *i_b,
+					size_t i_bSize ) {
+		return std::lexicographical_compare(
+			(const unsigned char *)i_a, (const unsigned char *)i_a + i_aSize,
+			(const unsigned char *)i_b, (const unsigned char *)i_b + i_bSize );
+	};
+	auto end = kContentOperators + kContentOperatorCount;
+	auto it = std::lower_bound( kContentOperators, end, i_name,
+								[&]( const char *i_op, const char *i_key ) {
+									return less( i_op, strlen( i_op ), i_key,
+												 i_size );
+								} );
+	if ( it == end or strlen( *it ) != i_size or
+		 memcmp( *it, i_name, i_size ) != 0 )
+		return kContentOperatorCount;
+	return it - kContentOperators;
+}
+
+// Instrumentation of the conversion of a document, with --stats.  The phases
+// run by the encoding threads add up the time spent on each of them, and the
+// write phase includes the decoding and encoding it waits for.
+class Stats
+{
+public:
+	enum phase_t
+	{
+		phase_visit,
+		phase_dedupe,
+		phase_decode,
+		phase_encode,
+		phase_write,
+
+		phase_count
+	};
+
+	// measures a phase on the current thread until destroyed, if any stats
+	class Timer
+	{
+	public:
+		Timer( Stats *i_stats, phase_t i_phase )
+			: _stats( i_stats ), _phase( i_phase )
+		{
+			if ( _stats != nullptr )
+			{
+				_wall = wallTime();
+				_cpu = cpuTime();
+			}
+		}
+		~Timer()
+		{
+			if ( _stats != nullptr )
+			{
+				_stats->_wall[_phase] += wallTime() - _wall;
+				_stats->_cpu[_phase] += cpuTime() - _cpu;
+			}
+		}
+
+		Timer( const Timer & ) = delete;
+		Timer &operator=( const Timer & ) = delete;
+
+	private:
+		Stats *_stats;
+		phase_t _phase;
+		uint64_t _wall, _cpu;
+	};
+
+	void decoded( size_t i_size ) { _decoded += i_size; }
+	void encoded( size_t i_size ) { _encoded += i_size; }
+	void written( uint64_t i_size ) { _written = i_size; }
+	void visited( size_t i_lookups, size_t i_hits )
+	{
+		_lookups = i_lookups;
+		_hits = i_hits;
+	}
+	// operator counts of a printed content stream, kContentOperatorCount + 1
+	void operators( const size_t *i_counts )
+	{
+		for ( size_t i = 0; i <= kContentOperatorCount; ++i )
+			_operators[i] += i_counts[i];
+	}
+	void counted( const std::vector<PDFObject *> &objectList )
+	{
+		for ( auto &it : objectList )
+		{
+			++_objects[it->type()];
+			_indirect += it->indirect();
+		}
+	}
+
+	// one line of JSON, with the error that stopped the conversion if any
+	std::string json( const std::string &i_path, const char *i_error ) const
+	{
+		static const char *const phases[phase_count] = {
+			"visit", "dedupe", "decode", "encode", "write"};
+		static const char *const types[] = {
+			"invalid", "boolean", "number", "string", "name",
+			"array",   "dict",	"stream", "null"};
+		std::string line = "{\"file\":" + jsonString( i_path );
+		if ( i_error != nullptr )
+			line += ",\"error\":" + jsonString( i_error );
+		char buffer[128];
+		line += ",\"phases\":{";
+		for ( int i = 0; i < phase_count; ++i )
+		{
+			snprintf( buffer, sizeof( buffer ),
+					  "%s\"%s\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f}",
+					  i == 0 ? "" : ",", phases[i], _wall[i] / 1e6,
+					  _cpu[i] / 1e6 );
+			line += buffer;
+		}
+		line += "},\"objects\":{";
+		for ( int i = PDFObject::type_boolean; i <= PDFObject::type_null; ++i )
+		{
+			snprintf( buffer, sizeof( buffer ), "\"%s\":%zu,",
+					  types[i], _objects[i] );
+			line += buffer;
+		}
+		snprintf( buffer, sizeof( buffer ), "\"indirect\":%zu}", _indirect );
+		line += buffer;
+		snprintf( buffer, sizeof( buffer ),
+				  ",\"bytes\":{\"decoded\":%llu,\"encoded\":%llu,"
+				  "\"written\":%llu}",
+				  (unsigned long long)_decoded, (unsigned long long)_encoded,
+				  (unsigned long long)_written );
+		line += buffer;
+		snprintf( buffer, sizeof( buffer ),
+				  ",\"visited\":{\"lookups\":%zu,\"hits\":%zu,"
+				  "\"hit_rate\":%.4f}",
+				  _lookups, _hits,
+				  _lookups > 0 ? (double)_hits / _lookups : 0.0 );
+		line += buffer;
+		// only with printed content streams
+		std::string operators;
+		for ( size_t i = 0; i <= kContentOperatorCount; ++i )
+		{
+			if ( _operators[i] == 0 )
+				continue;
+			operators += operators.empty() ? ",\"operators\":{" : ",";
+			operators += jsonString( i < kContentOperatorCount
+										 ? kContentOperators[i]
+										 : "other" ) +
+						 ":" + std::to_string( _operators[i] );
+		}
+		if ( not operators.empty() )
+			line += operators + "}";
+		snprintf( buffer, sizeof( buffer ), ",\"peak_rss\":%zu}", PeakRSS() );
+		return line + buffer;
+	}
+
+	static std::string jsonString( const std::string &i_s )
+	{
+		std::string quoted = "\"";
+		for ( unsigned char c : i_s )
+		{
+			if ( c == '"' or c == '\\' )
+				quoted += '\\';
+			if ( c < 0x20 )
+			{
+				char escape[8];
+				snprintf( escape, sizeof( escape ), "\\u%04x", c );
+				quoted += escape;
+			}
+			else
+				quoted += c;
+		}
+		return quoted + "\"";
+	}
+
+private:
+	static uint64_t wallTime()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				   std::chrono::steady_clock::now().time_since_epoch() )
+			.count();
+	}
+	static uint64_t cpuTime()
+	{
+		struct timespec t;
+		clock_gettime( CLOCK_THREAD_CPUTIME_ID, &t );
+		return t.tv_sec * 1000000000ull + t.tv_nsec;
+	}
+
+	std::atomic<uint64_t> _wall[phase_count]{};
+	std::atomic<uint64_t> _cpu[phase_count]{};
+	std::atomic<uint64_t> _decoded{0}, _encoded{0};
+	std::atomic<uint64_t> _operators[kContentOperatorCount + 1]{};
+	uint64_t _written{0};
+	size_t _objects[PDFObject::type_null + 1]{};
+	size_t _indirect{0};
+	size_t _lookups{0}, _hits{0};
+};
+
+// the options of a conversion, and what the session gives it
+struct SaveOptions : ConvertOptions
+{
+	// shared by the documents of the session, can be null
+	StreamCache *cache{nullptr};
+	SpillFile *spill{nullptr};
+	// of the document being converted, can be null
+	Stats *stats{nullptr};
+	Budget *budget{nullptr};
+};
+
+PDFObject *VisitDict( CGPDFDictionaryRef dict, Context &ctx );
+PDFObject *VisitObject( CGPDFObjectRef obj, Context &ctx );
+PDFObject *VisitPages( CGPDFDocumentRef doc, CGPDFDictionaryRef catalog,
+					   const SaveOptions &options, Context &ctx );
+void SelectParts( const SaveOptions &options, Context &ctx );
+
+// where an indirect object is written
+struct XrefEntry
+{
+	uint64_t offset;
+	// with objectStreams, the object stream holding it and its index there,
+	// 0 for an object written at offset
+	int stream;
+	size_t index;
+};
+
+void WriteObject( OutputSink &s, const PDFObject *obj );
+void WriteObjects( OutputSink &s, const std::vector<PDFObject *> &objectList,
+				   const std::vector<size_t> &groups,
+				   std::map<int, XrefEntry> &xref, const SaveOptions &options,
+				   WorkerPool *pool, Incremental *incremental );
+void WriteXrefStream( OutputSink &s, std::map<int, XrefEntry> &xref,
+					  const PDFObject *i_root, const PDFObject *i_info,
+					  const SaveOptions &options );
+
+// groups: indices in objectList where a group of objects starts, the output
+// is flushed after each group
+void SavePDF( OutputSink &s, int majorVersion, int minorVersion,
+			  const std::vector<PDFObject *> &objectList,
+			  const std::vector<size_t> &groups,
+			  PDFObject *i_root, PDFObject *i_info,
+			  const SaveOptions &options, WorkerPool *pool,
+			  Incremental *incremental )
+{
+	// set the ID of all object that will be written as indirect object
+	int i = 0;
+	for ( auto &it : objectList )
+	{
+		if ( it->indirect() )
+			it->setID( ++i );
+	}
+
+	// locate Contents
+	for ( auto &it : objectList )
+	{
+		auto dict = it->asDictionary();
+		if ( dict != nullptr )
+		{
+			auto obj = dict->value( sym_Type );
+			if ( obj != nullptr )
+			{
+				auto type = obj->asName();
+				if ( type != nullptr )
+				{
+					if ( type->symbol() == sym_Page )
+					{
+						// a stream or an array of streams
+						obj = dict->value( sym_Contents );
+						auto array = obj != nullptr ? obj->asArray() : nullptr;
+						size_t count = array != nullptr ? array->count()
+														: obj != nullptr;
+						for ( size_t i = 0; i < count; ++i )
+						{
+							auto contents =
+								( array != nullptr ? array->value( i ) : obj )
+									->asStream();
+							if ( contents != nullptr )
+							{
+								contents->outputAsText = true;
+								contents->contents = true;
+							}
+						}
+					}
+				}
+			}
+			continue;
+		}
+		auto stream = it->asStream();
+		if ( stream != nullptr )
+		{
+			auto dict = stream->dict();
+			auto obj = dict->value( sym_FunctionType );
+			if ( obj != nullptr )
+			{
+				auto num = obj->asNumber();
+				if ( num != nullptr )
+				{
+					if ( num->intValue() == 4 )
+						stream->outputAsText = true;
+				}
+			}
+			continue;
+		}
+	}
+
+	// header, object and xref streams are from PDF 1.5
+	if ( options.objectStreams and majorVersion == 1 and minorVersion < 5 )
+		minorVersion = 5;
+	s << "%PDF-" << majorVersion << "." << minorVersion << "\n";
+	s << "%...\n";
+
+	// write all objects and build the xref
+	std::map<int, XrefEntry> xref;
+	WriteObjects( s, objectList, groups, xref, options, pool, incremental );
+
+	auto startXref = s.offset();
+	if ( options.objectStreams )
+	{
+		// the xref stream holds the trailer
+		WriteXrefStream( s, xref, i_root, i_info, options );
+		s << "startxref\n";
+		s << startXref << "\n";
+		s << "%%EOF\n";
+		return;
+	}
+
+	//	xref
+	s << "xref\n";
+	s << "0 " << xref.size() << "\n";
+	s << "0000000000 00000 n \n";
+	for ( i = 1; i < xref.size() + 1; ++i )
+	{
+		char line[32];
+		snprintf( line, sizeof( line ), "%010llu 00000 n \n",
+				  (unsigned long long)xref[i].offset );
+		s << line;
+	}
+
+	// trailer
+	s << "trailer\n";
+	s << "<< /Size " << xref.size() << " /Root " << i_root->getID()
+	  << " 0 R /Info " << i_info->getID() << " 0 R>>\n";
+	s << "startxref\n";
+	s << startXref << "\n";
+	s << "%%EOF\n";
+}
+
+// ASCIIHex encoding: every byte becomes two hex digits, and a newline is
+// inserted after each group of kHexBytesPerLine input bytes.
+const size_t kHexBytesPerLine = 40;
+const size_t kHexLineSize = 2 * kHexBytesPerLine + 1;
+
+// size of the encoded data, including the final newline
+size_t hexEncodedSize( size_t i_size )
+{
+	return 2 * i_size + i_size / kHexBytesPerLine + 1;
+}
+
+struct HexTable
+{
+	HexTable()
+	{
+		const char digits[] = "0123456789ABCDEF";
+		for ( int i = 0; i < 256; ++i )
+		{
+			pairs[2 * i] = digits[i >> 4];
+			pairs[2 * i + 1] = digits[i & 0x0F];
+		}
+	}
+
+	char pairs[512];
+};
+const HexTable kHexTable;
+
+// each kernel encodes i_lines complete lines and returns the end of the output
+typedef char *( *HexLinesKernel )( const UInt8 *i_src, size_t i_lines,
+								   char *o_dst );
+
+char *hexEncodeLinesScalar( const UInt8 *i_src, size_t i_lines, char *o_dst )
+{
+	for ( size_t l = 0; l < i_lines; ++l )
+	{
+		for ( size_t i = 0; i < kHexBytesPerLine; ++i )
+			memcpy( o_dst + 2 * i, kHexTable.pairs + 2 * i_src[i], 2 );
+		o_dst[kHexLineSize - 1] = '\n';
+		i_src += kHexBytesPerLine;
+		o_dst += kHexLineSize;
+	}
+	return o_dst;
+}
+
+#if PDF2TEXT_HEX_X86
+__attribute__( ( target( "ssse3" ) ) ) inline void hexEncode8SSSE3(
+	const UInt8 *i_src, char *o_dst )
+{
+	const __m128i digits =
+		_mm_setr_epi8( '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A',
+					   'B', 'C', 'D', 'E', 'F' );
+	const __m128i mask = _mm_set1_epi8( 0x0F );
+	__m128i v = _mm_loadl_epi64( (const __m128i *)i_src );
+	__m128i hi = _mm_shuffle_epi8(
+		digits, _mm_and_si128( _mm_srli_epi16( v, 4 ), mask ) );
+	__m128i lo = _mm_shuffle_epi8( digits, _mm_and_si128( v, mask ) );
+	_mm_storeu_si128( (__m128i *)o_dst, _mm_unpacklo_epi8( hi, lo ) );
+}
+
+__attribute__( ( target( "ssse3" ) ) ) inline void hexEncode16SSSE3(
+	const UInt8 *i_src, char *o_dst )
+{
+	const __m128i digits =
+		_mm_setr_epi8( '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A',
+					   'B', 'C', 'D', 'E', 'F' );
+	const __m128i mask = _mm_set1_epi8( 0x0F );
+	__m128i v = _mm_loadu_si128( (const __m128i *)i_src );
+	__m128i hi = _mm_shuffle_epi8(
+		digits, _mm_and_si128( _mm_srli_epi16( v, 4 ), mask ) );
+	__m128i lo = _mm_shuffle_epi8( digits, _mm_and_si128( v, mask ) );
+	_mm_storeu_si128( (__m128i *)o_dst, _mm_unpacklo_epi8( hi, lo ) );
+	_mm_storeu_si128( (__m128i *)( o_dst + 16 ),
+					  _mm_unpackhi_epi8( hi, lo ) );
+}
+
+__attribute__( ( target( "ssse3" ) ) ) char *hexEncodeLinesSSSE3(
+	const UInt8 *i_src, size_t i_lines, char *o_dst )
+{
+	for ( size_t l = 0; l < i_lines; ++l )
+	{
+		hexEncode16SSSE3( i_src, o_dst );
+		hexEncode16SSSE3( i_src + 16, o_dst + 32 );
+		hexEncode8SSSE3( i_src + 32, o_dst + 64 );
+		o_dst[kHexLineSize - 1] = '\n';
+		i_src += kHexBytesPerLine;
+		o_dst += kHexLineSize;
+	}
+	return o_dst;
+}
+
+__attribute__( ( target( "avx2" ) ) ) char *hexEncodeLinesAVX2(
+	const UInt8 *i_src, size_t i_lines, char *o_dst )
+{
+	const __m256i digits = _mm256_broadcastsi128_si256(
+		_mm_setr_epi8( '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A',
+					   'B', 'C', 'D', 'E', 'F' ) );
+	const __m256i mask = _mm256_set1_epi8( 0x0F );
+	for ( size_t l = 0; l < i_lines; ++l )
+	{
+		__m256i v = _mm256_loadu_si256( (const __m256i *)i_src );
+		__m256i hi = _mm256_shuffle_epi8(
+			digits, _mm256_and_si256( _mm256_srli_epi16( v, 4 ), mask ) );
+		__m256i lo = _mm256_shuffle_epi8( digits, _mm256_and_si256( v, mask ) );
+		// unpack works per 128 bits lane, so a holds bytes 0-7 and 16-23 and b
+		// holds bytes 8-15 and 24-31
+		__m256i a = _mm256_unpacklo_epi8( hi, lo );
+		__m256i b = _mm256_unpackhi_epi8( hi, lo );
+		_mm256_storeu_si256( (__m256i *)o_dst,
+							 _mm256_permute2x128_si256( a, b, 0x20 ) );
+		_mm256_storeu_si256( (__m256i *)( o_dst + 32 ),
+							 _mm256_permute2x128_si256( a, b, 0x31 ) );
+		hexEncode8SSSE3( i_src + 32, o_dst + 64 );
+		o_dst[kHexLineSize - 1] = '\n';
+		i_src += kHexBytesPerLine;
+		o_dst += kHexLineSize;
+	}
+	return o_dst;
+}
+#endif
+
+#if PDF2TEXT_HEX_NEON
+char *hexEncodeLinesNEON( const UInt8 *i_src, size_t i_lines, char *o_dst )
+{
+	const uint8x16_t digits =
+		vld1q_u8( (const uint8_t *)"0123456789ABCDEF" );
+	const uint8x16_t mask = vdupq_n_u8( 0x0F );
+	for ( size_t l = 0; l < i_lines; ++l )
+	{
+		for ( size_t i = 0; i < 32; i += 16 )
+		{
+			uint8x16_t v = vld1q_u8( i_src + i );
+			uint8x16x2_t hex;
+			hex.val[0] = vqtbl1q_u8( digits, vshrq_n_u8( v, 4 ) );
+			hex.val[1] = vqtbl1q_u8( digits, vandq_u8( v, mask ) );
+			vst2q_u8( (uint8_t *)o_dst + 2 * i, hex );
+		}
+		uint8x8_t v = vld1_u8( i_src + 32 );
+		uint8x8x2_t hex;
+		hex.val[0] = vqtbl1_u8( digits, vshr_n_u8( v, 4 ) );
+		hex.val[1] = vqtbl1_u8( digits, vand_u8( v, vget_low_u8( mask ) ) );
+		vst2_u8( (uint8_t *)o_dst + 64, hex );
+		o_dst[kHexLineSize - 1] = '\n';
+		i_src += kHexBytesPerLine;
+		o_dst += kHexLineSize;
+	}
+	return o_dst;
+}
+#endif
+
+HexLinesKernel selectHexKernel()
+{
+#if PDF2TEXT_HEX_X86
+	if ( __builtin_cpu_supports( "avx2" ) )
+		return hexEncodeLinesAVX2;
+	if ( __builtin_cpu_supports( "ssse3" ) )
+		return hexEncodeLinesSSSE3;
+#elif PDF2TEXT_HEX_NEON
+	return hexEncodeLinesNEON;
+#endif
+	return hexEncodeLinesScalar;
+}
+
+// Encode i_size bytes to o_dst, without the final newline.  Returns the end of
+// the output.  Calling it on consecutive slices whose size is a multiple of
+// kHexBytesPerLine gives the same output as a single call.
+char *hexEncode( const UInt8 *i_src, size_t i_size, char *o_dst )
+{
+	static const HexLinesKernel kernel = selectHexKernel();
+
+	size_t lines = i_size / kHexBytesPerLine;
+	o_dst = kernel( i_src, lines, o_dst );
+	i_src += lines * kHexBytesPerLine;
+	for ( size_t i = 0; i < i_size % kHexBytesPerLine; ++i, o_dst += 2 )
+		memcpy( o_dst, kHexTable.pairs + 2 * i_src[i], 2 );
+	return o_dst;
+}
+
+// ASCII85 encoding: every 4 bytes become 5 base 85 digits from '!'.  A last
+// group of n < 4 bytes is padded with zeros and gives n + 1 digits.  The 'z'
+// shortcut for zero groups is not used, so the encoded size only depends on
+// the input size, in lines of kA85BytesPerLine bytes.
+const size_t kA85BytesPerLine = 64;
+const size_t kA85LineSize = kA85BytesPerLine / 4 * 5 + 1;
+
+// encoded size of i_size bytes, with the final "~>" and newline
+size_t ascii85EncodedSize( size_t i_size )
+{
+	size_t tail = i_size % 4;
+	return i_size / 4 * 5 + ( tail != 0 ? tail + 1 : 0 ) +
+		   i_size / kA85BytesPerLine + 3;
+}
+
+// write the 5 digits of the group to o_dst
+inline void ascii85Group( uint32_t i_value, char *o_dst )
+{
+	for ( int i = 4; i >= 0; --i )
+	{
+		o_dst[i] = '!' + (char)( i_value % 85 );
+		i_value /= 85;
+	}
+}
+
+inline uint32_t loadBigEndian32( const UInt8 *i_src )
+{
+	return (uint32_t)i_src[0] << 24 | (uint32_t)i_src[1] << 16 |
+		   (uint32_t)i_src[2] << 8 | (uint32_t)i_src[3];
+}
+
+// encode i_lines full lines, returns the end of the output
+typedef char *( *A85LinesKernel )( const UInt8 *i_src, size_t i_lines,
+								   char *o_dst );
+
+char *ascii85EncodeLinesScalar( const UInt8 *i_src, size_t i_lines,
+								char *o_dst )
+{
+	for ( size_t l = 0; l < i_lines; ++l )
+	{
+		for ( size_t g = 0; g < kA85BytesPerLine / 4; ++g )
+			ascii85Group( loadBigEndian32( i_src + 4 * g ), o_dst + 5 * g );
+		o_dst[kA85LineSize - 1] = '\n';
+		i_src += kA85BytesPerLine;
+		o_dst += kA85LineSize;
+	}
+	return o_dst;
+}
+
+#if PDF2TEXT_HEX_X86
+// The SIMD kernels divide the 32 bits groups by 85 with a multiplication:
+// x / 85 == x * kA85Magic >> 38 for every 32 bits x.
+const uint32_t kA85Magic = 3233857729u;
+
+// quotient and remainder by 85 of the 4 groups of i_value
+__attribute__( ( target( "sse4.1" ) ) ) inline __m128i div85SSE41(
+	__m128i i_value, __m128i &o_remainder )
+{
+	const __m128i magic = _mm_set1_epi32( (int)kA85Magic );
+	__m128i even = _mm_srli_epi64( _mm_mul_epu32( i_value, magic ), 38 );
+	__m128i odd = _mm_srli_epi64(
+		_mm_mul_epu32( _mm_srli_epi64( i_value, 32 ), magic ), 38 );
+	__m128i q = _mm_blend_epi16( even, _mm_slli_epi64( odd, 32 ), 0xCC );
+	o_remainder =
+		_mm_sub_epi32( i_value, _mm_mullo_epi32( q, _mm_set1_epi32( 85 ) ) );
+	return q;
+}
+
+// Digits of 4 groups: the first four of each group in the bytes of a 32 bits
+// lane, in o_first, and the last one in the low byte of a lane, in o_last.
+__attribute__( ( target( "sse4.1" ) ) ) inline void ascii85Digits4SSE41(
+	__m128i i_value, __m128i &o_first, __m128i &o_last )
+{
+	__m128i d3, d2, d1, d0;
+	i_value = div85SSE41( i_value, o_last );
+	i_value = div85SSE41( i_value, d3 );
+	i_value = div85SSE41( i_value, d2 );
+	d0 = div85SSE41( i_value, d1 );
+	o_first = _mm_or_si128(
+		_mm_or_si128( d0, _mm_slli_epi32( d1, 8 ) ),
+		_mm_or_si128( _mm_slli_epi32( d2, 16 ), _mm_slli_epi32( d3, 24 ) ) );
+	o_first = _mm_add_epi8( o_first, _mm_set1_epi8( '!' ) );
+	o_last = _mm_add_epi8( o_last, _mm_set1_epi8( '!' ) );
+}
+
+// write the 20 digits of 4 groups to o_dst
+__attribute__( ( target( "sse4.1" ) ) ) inline void ascii85Store4SSE41(
+	__m128i i_first, __m128i i_last, char *o_dst )
+{
+	// -1 gives a zero byte, so the shuffles of both vectors can be or'ed
+	const __m128i firstHead =
+		_mm_setr_epi8( 0, 1, 2, 3, -1, 4, 5, 6, 7, -1, 8, 9, 10, 11, -1, 12 );
+	const __m128i lastHead = _mm_setr_epi8( -1, -1, -1, -1, 0, -1, -1, -1, -1,
+											4, -1, -1, -1, -1, 8, -1 );
+	const __m128i firstTail = _mm_setr_epi8( 13, 14, 15, -1, -1, -1, -1, -1,
+											 -1, -1, -1, -1, -1, -1, -1, -1 );
+	const __m128i lastTail = _mm_setr_epi8( -1, -1, -1, 12, -1, -1, -1, -1,
+											-1, -1, -1, -1, -1, -1, -1, -1 );
+	__m128i head = _mm_or_si128( _mm_shuffle_epi8( i_first, firstHead ),
+								 _mm_shuffle_epi8( i_last, lastHead ) );
+	__m128i tail = _mm_or_si128( _mm_shuffle_epi8( i_first, firstTail ),
+								 _mm_shuffle_epi8( i_last, lastTail ) );
+	_mm_storeu_si128( (__m128i *)o_dst, head );
+	uint32_t t = (uint32_t)_mm_cvtsi128_si32( tail );
+	memcpy( o_dst + 16, &t, 4 );
+}
+
+__attribute__( ( target( "sse4.1" ) ) ) char *ascii85EncodeLinesSSE41(
+	const UInt8 *i_src, size_t i_lines, char *o_dst )
+{
+	const __m128i bigEndian =
+		_mm_setr_epi8( 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 );
+	for ( size_t l = 0; l < i_lines; ++l )
+	{
+		for ( size_t i = 0; i < kA85BytesPerLine; i += 16 )
+		{
+			__m128i v = _mm_shuffle_epi8(
+				_mm_loadu_si128( (const __m128i *)( i_src + i ) ), bigEndian );
+			__m128i first, last;
+			ascii85Digits4SSE41( v, first, last );
+			ascii85Store4SSE41( first, last, o_dst + i / 4 * 5 );
+		}
+		o_dst[kA85LineSize - 1] = '\n';
+		i_src += kA85BytesPerLine;
+		o_dst += kA85LineSize;
+	}
+	return o_dst;
+}
+
+__attribute__( ( target( "avx2" ) ) ) inline __m256i div85AVX2(
+	__m256i i_value, __m256i &o_remainder )
+{
+	const __m256i magic = _mm256_set1_epi32( (int)kA85Magic );
+	__m256i even = _mm256_srli_epi64( _mm256_mul_epu32( i_value, magic ), 38 );
+	__m256i odd = _mm256_srli_epi64(
+		_mm256_mul_epu32( _mm256_srli_epi64( i_value, 32 ), magic ), 38 );
+	__m256i q = _mm256_blend_epi32( even, _mm256_slli_epi64( odd, 32 ), 0xAA );
+	o_remainder = _mm256_sub_epi32(
+		i_value, _mm256_mullo_epi32( q, _mm256_set1_epi32( 85 ) ) );
+	return q;
+}
+
+__attribute__( ( target( "avx2" ) ) ) char *ascii85EncodeLinesAVX2(
+	const UInt8 *i_src, size_t i_lines, char *o_dst )
+{
+	const __m256i bigEndian = _mm256_broadcastsi128_si256(
+		_mm_setr_epi8( 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 ) );
+	for ( size_t l = 0; l < i_lines; ++l )
+	{
+		for ( size_t i = 0; i < kA85BytesPerLine; i += 32 )
+		{
+			__m256i v = _mm256_shuffle_epi8(
+				_mm256_loadu_si256( (const __m256i *)( i_src + i ) ),
+				bigEndian );
+			__m256i d4, d3, d2, d1, d0;
+			v = div85AVX2( v, d4 );
+			v = div85AVX2( v, d3 );
+			v = div85AVX2( v, d2 );
+			d0 = div85AVX2( v, d1 );
+			__m256i first = _mm256_or_si256(
+				_mm256_or_si256( d0, _mm256_slli_epi32( d1, 8 ) ),
+				_mm256_or_si256( _mm256_slli_epi32( d2, 16 ),
+								 _mm256_slli_epi32( d3, 24 ) ) );
+			first = _mm256_add_epi8( first, _mm256_set1_epi8( '!' ) );
+			__m256i last = _mm256_add_epi8( d4, _mm256_set1_epi8( '!' ) );
+			char *dst = o_dst + i / 4 * 5;
+			ascii85Store4SSE41( _mm256_castsi256_si128( first ),
+								_mm256_castsi256_si128( last ), dst );
+			ascii85Store4SSE41( _mm256_extracti128_si256( first, 1 ),
+								_mm256_extracti128_si256( last, 1 ), dst + 20 );
+		}
+		o_dst[kA85LineSize - 1] = '\n';
+		i_src += kA85BytesPerLine;
+		o_dst += kA85LineSize;
+	}
+	return o_dst;
+}
+#endif
+
+A85LinesKernel selectA85Kernel()
+{
+#if PDF2TEXT_HEX_X86
+	if ( __builtin_cpu_supports( "avx2" ) )
+		return ascii85EncodeLinesAVX2;
+	if ( __builtin_cpu_supports( "sse4.1" ) )
+		return ascii85EncodeLinesSSE41;
+#endif
+	return ascii85EncodeLinesScalar;
+}
+
+// Encode i_size bytes to o_dst, without the end marker.  Returns the end of
+// the output.  Like hexEncode(), consecutive slices whose size is a multiple
+// of kA85BytesPerLine give the same output as a single call.
+char *ascii85Encode( const UInt8 *i_src, size_t i_size, char *o_dst )
+{
+	static const A85LinesKernel kernel = selectA85Kernel();
+
+	size_t lines = i_size / kA85BytesPerLine;
+	o_dst = kernel( i_src, lines, o_dst );
+	i_src += lines * kA85BytesPerLine;
+	size_t rest = i_size % kA85BytesPerLine;
+	for ( ; rest >= 4; rest -= 4, i_src += 4, o_dst += 5 )
+		ascii85Group( loadBigEndian32( i_src ), o_dst );
+	if ( rest != 0 )
+	{
+		UInt8 last[4] = {};
+		memcpy( last, i_src, rest );
+		char digits[5];
+		ascii85Group( loadBigEndian32( last ), digits );
+		o_dst = std::copy( digits, digits + rest + 1, o_dst );
+	}
+	return o_dst;
+}
+
+// Bytes that can be written as they are in a text stream: printable ASCII and
+// the usual whitespace.
+struct TextBytes
+{
+	TextBytes()
+	{
+		for ( int c = 0; c < 256; ++c )
+			text[c] = ( c >= 0x20 and c < 0x7F ) or c == '\t' or c == '\n' or
+					  c == '\f' or c == '\r';
+	}
+
+	bool text[256];
+};
+const TextBytes kTextBytes;
+
+// number of bytes checked at once by the text kernels
+const size_t kTextBlockSize = 64;
+
+// whether the i_blocks blocks of kTextBlockSize bytes are all text
+typedef bool ( *TextBlocksKernel )( const UInt8 *i_src, size_t i_blocks );
+
+bool isTextBlocksScalar( const UInt8 *i_src, size_t i_blocks )
+{
+	for ( size_t b = 0; b < i_blocks; ++b, i_src += kTextBlockSize )
+	{
+		bool text = true;
+		for ( size_t i = 0; i < kTextBlockSize; ++i )
+			text &= kTextBytes.text[i_src[i]];
+		if ( not text )
+			return false;
+	}
+	return true;
+}
+
+#if PDF2TEXT_HEX_X86
+__attribute__( ( target( "sse2" ) ) ) inline __m128i isText16SSE2(
+	const UInt8 *i_src )
+{
+	__m128i v = _mm_loadu_si128( (const __m128i *)i_src );
+	// bytes from 0x80 are negative so fail the first comparison
+	__m128i printable =
+		_mm_and_si128( _mm_cmpgt_epi8( v, _mm_set1_epi8( 0x1F ) ),
+					   _mm_cmplt_epi8( v, _mm_set1_epi8( 0x7F ) ) );
+	__m128i space =
+		_mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8( v, _mm_set1_epi8( '\t' ) ),
+									_mm_cmpeq_epi8( v, _mm_set1_epi8( '\n' ) ) ),
+					  _mm_or_si128( _mm_cmpeq_epi8( v, _mm_set1_epi8( '\f' ) ),
+									_mm_cmpeq_epi8( v, _mm_set1_epi8( '\r' ) ) ) );
+	return _mm_or_si128( printable, space );
+}
+
+__attribute__( ( target( "sse2" ) ) ) bool isTextBlocksSSE2(
+	const UInt8 *i_src, size_t i_blocks )
+{
+	for ( size_t b = 0; b < i_blocks; ++b, i_src += kTextBlockSize )
+	{
+		__m128i text = _mm_and_si128(
+			_mm_and_si128( isText16SSE2( i_src ), isText16SSE2( i_src + 16 ) ),
+			_mm_and_si128( isText16SSE2( i_src + 32 ),
+						   isText16SSE2( i_src + 48 ) ) );
+		if ( _mm_movemask_epi8( text ) != 0xFFFF )
+			return false;
+	}
+	return true;
+}
+
+__attribute__( ( target( "avx2" ) ) ) inline __m256i isText32AVX2(
+	const UInt8 *i_src )
+{
+	__m256i v = _mm256_loadu_si256( (const __m256i *)i_src );
+	__m256i printable = _mm256_andnot_si256(
+		_mm256_cmpgt_epi8( v, _mm256_set1_epi8( 0x7E ) ),
+		_mm256_cmpgt_epi8( v, _mm256_set1_epi8( 0x1F ) ) );
+	__m256i space = _mm256_or_si256(
+		_mm256_or_si256( _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '\t' ) ),
+						 _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '\n' ) ) ),
+		_mm256_or_si256( _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '\f' ) ),
+						 _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '\r' ) ) ) );
+	return _mm256_or_si256( printable, space );
+}
+
+__attribute__( ( target( "avx2" ) ) ) bool isTextBlocksAVX2(
+	const UInt8 *i_src, size_t i_blocks )
+{
+	for ( size_t b = 0; b < i_blocks; ++b, i_src += kTextBlockSize )
+	{
+		__m256i text =
+			_mm256_and_si256( isText32AVX2( i_src ), isText32AVX2( i_src + 32 ) );
+		if ( (unsigned)_mm256_movemask_epi8( text ) != 0xFFFFFFFFu )
+			return false;
+	}
+	return true;
+}
+#endif
+
+#if PDF2TEXT_HEX_NEON
+bool isTextBlocksNEON( const UInt8 *i_src, size_t i_blocks )
+{
+	for ( size_t b = 0; b < i_blocks; ++b, i_src += kTextBlockSize )
+	{
+		uint8x16_t text = vdupq_n_u8( 0xFF );
+		for ( size_t i = 0; i < kTextBlockSize; i += 16 )
+		{
+			uint8x16_t v = vld1q_u8( i_src + i );
+			// 0x20-0x7E, or 0x09, 0x0A, 0x0C, 0x0D
+			uint8x16_t printable = vcltq_u8( vsubq_u8( v, vdupq_n_u8( 0x20 ) ),
+											 vdupq_n_u8( 0x5F ) );
+			uint8x16_t space = vorrq_u8(
+				vorrq_u8( vceqq_u8( v, vdupq_n_u8( '\t' ) ),
+						  vceqq_u8( v, vdupq_n_u8( '\n' ) ) ),
+				vorrq_u8( vceqq_u8( v, vdupq_n_u8( '\f' ) ),
+						  vceqq_u8( v, vdupq_n_u8( '\r' ) ) ) );
+			text = vandq_u8( text, vorrq_u8( printable, space ) );
+		}
+		if ( vminvq_u8( text ) == 0 )
+			return false;
+	}
+	return true;
+}
+#endif
+
+TextBlocksKernel selectTextKernel()
+{
+#if PDF2TEXT_HEX_X86
+	if ( __builtin_cpu_supports( "avx2" ) )
+		return isTextBlocksAVX2;
+	if ( __builtin_cpu_supports( "sse2" ) )
+		return isTextBlocksSSE2;
+#elif PDF2TEXT_HEX_NEON
+	return isTextBlocksNEON;
+#endif
+	return isTextBlocksScalar;
+}
+
+// whether the data can be written without encoding in a text file
+bool isTextData( const UInt8 *i_src, size_t i_size )
+{
+	static const TextBlocksKernel kernel = selectTextKernel();
+
+	size_t blocks = i_size / kTextBlockSize;
+	if ( not kernel( i_src, blocks ) )
+		return false;
+	for ( size_t i = blocks * kTextBlockSize; i < i_size; ++i )
+	{
+		if ( not kTextBytes.text[i_src[i]] )
+			return false;
+	}
+	return true;
+}
+
+// Characters written as #xx in a name: '#', the delimiters, and everything
+// that is not printable ASCII.
+struct NameEscapes
+{
+	NameEscapes()
+	{
+		for ( int c = 0; c < 256; ++c )
+			escape[c] = c < 0x21 or c > 0x7E or strchr( "#()<>[]{}/%", c );
+	}
+
+	bool escape[256];
+};
+const NameEscapes kNameEscapes;
+
+void writeName( OutputSink &s, const ArenaString &i_name )
+{
+	s << '/';
+	auto run = i_name.begin();
+	for ( auto it = run; it != i_name.end(); ++it )
+	{
+		unsigned char c = *it;
+		if ( kNameEscapes.escape[c] )
+		{
+			s.write( run, it - run );
+			char escaped[3] = {'#', kHexTable.pairs[2 * c],
+							   kHexTable.pairs[2 * c + 1]};
+			s.write( escaped, 3 );
+			run = it + 1;
+		}
+	}
+	s.write( run, i_name.end() - run );
+}
+
+// size of the stream body once converted
+size_t encodedSize( encoding_t encoding, size_t i_size )
+{
+	switch ( encoding )
+	{
+		case encoding_hex:
+			return hexEncodedSize( i_size );
+		case encoding_ascii85:
+			return ascii85EncodedSize( i_size );
+		default:
+			return i_size;
+	}
+}
+
+size_t convertedSize( CFDataRef data, encoding_t encoding )
+{
+	return encodedSize( encoding, CFDataGetLength( data ) );
+}
+
+// Encode a slice of the body, a multiple of encodedLineBytes() unless it is
+// the last one.  Returns the end of the output.
+char *encodeSlice( encoding_t encoding, const UInt8 *i_src, size_t i_size,
+				   char *o_dst )
+{
+	if ( encoding == encoding_ascii85 )
+		return ascii85Encode( i_src, i_size, o_dst );
+	return hexEncode( i_src, i_size, o_dst );
+}
+
+// end of an encoded body
+const char *encodedEnd( encoding_t encoding )
+{
+	return encoding == encoding_ascii85 ? "~>\n" : "\n";
+}
+
+size_t encodedLineBytes( encoding_t encoding )
+{
+	return encoding == encoding_ascii85 ? kA85BytesPerLine : kHexBytesPerLine;
+}
+
+size_t encodedLineSize( encoding_t encoding )
+{
+	return encoding == encoding_ascii85 ? kA85LineSize : kHexLineSize;
+}
+
+// number of input lines encoded at once when streaming a body
+const size_t kConvertChunkLines = 1024;
+
+// Write the converted stream body to s, encoding it chunk by chunk so only
+// one chunk of encoded data is held in memory.
+void writeConvertedData( OutputSink &s, CFDataRef data, encoding_t encoding )
+{
+	auto ptr = CFDataGetBytePtr( data );
+	size_t l = CFDataGetLength( data );
+
+	if ( encoding == encoding_none )
+	{
+		s.write( (const char *)ptr, l );
+		return;
+	}
+
+	// encode directly in the buffer of the sink, a chunk of lines and the
+	// end of its last one fit in what it can reserve
+	const size_t chunkSize =
+		std::min( kConvertChunkLines,
+				  ( s.maxReserve() - 3 ) / encodedLineSize( encoding ) ) *
+		encodedLineBytes( encoding );
+	for ( size_t i = 0; i < l; i += chunkSize )
+	{
+		size_t n = std::min( chunkSize, l - i );
+		auto buffer = s.reserve( encodedSize( encoding, n ) );
+		auto end = encodeSlice( encoding, ptr + i, n, buffer );
+		s.commit( end - buffer );
+	}
+	s << encodedEnd( encoding );
+}
+
+// final mix of the hashes
+inline uint64_t hashMix( uint64_t h )
+{
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDull;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+// hash of bytes, read 8 at a time
+uint64_t hashBytes( const void *i_data, size_t i_size, uint64_t i_seed )
+{
+	const uint64_t k = 0x9E3779B97F4A7C15ull;
+	auto p = (const UInt8 *)i_data;
+	uint64_t h = i_seed ^ ( i_size * k );
+	for ( ; i_size >= 8; i_size -= 8, p += 8 )
+	{
+		uint64_t w;
+		memcpy( &w, p, 8 );
+		h = ( h ^ w ) * k;
+		h ^= h >> 29;
+	}
+	uint64_t w = 0;
+	memcpy( &w, p, i_size );
+	return hashMix( h ^ w );
+}
+
+// SHA-256 of data found again across documents and runs, which unlike the
+// hashes above a document can't be made to collide with
+struct ContentDigest
+{
+	unsigned char bytes[CC_SHA256_DIGEST_LENGTH];
+
+	bool operator==( const ContentDigest &i_other ) const
+	{
+		return memcmp( bytes, i_other.bytes, sizeof( bytes ) ) == 0;
+	}
+	bool operator<( const ContentDigest &i_other ) const
+	{
+		return memcmp( bytes, i_other.bytes, sizeof( bytes ) ) < 0;
+	}
+
+	std::string hex() const
+	{
+		static const char digits[] = "0123456789abcdef";
+		std::string s;
+		for ( auto b : bytes )
+		{
+			s += digits[b >> 4];
+			s += digits[b & 15];
+		}
+		return s;
+	}
+
+	// false unless i_hex is what hex() returns
+	bool fromHex( const std::string &i_hex )
+	{
+		if ( i_hex.size() != 2 * sizeof( bytes ) )
+			return false;
+		for ( size_t i = 0; i < i_hex.size(); ++i )
+		{
+			char c = i_hex[i];
+			int v = c >= '0' and c <= '9'   ? c - '0'
+					: c >= 'a' and c <= 'f' ? c - 'a' + 10
+											: -1;
+			if ( v < 0 )
+				return false;
+			if ( i % 2 == 0 )
+				bytes[i / 2] = (unsigned char)( v << 4 );
+			else
+				bytes[i / 2] |= (unsigned char)v;
+		}
+		return true;
+	}
+};
+
+class Digest
+{
+public:
+	Digest() { CC_SHA256_Init( &_context ); }
+
+	void update( const void *i_data, size_t i_size )
+	{
+		// CC_LONG is 32 bits
+		auto p = (const UInt8 *)i_data;
+		for ( size_t n; i_size > 0; p += n, i_size -= n )
+		{
+			n = std::min<size_t>( i_size, 1 << 30 );
+			CC_SHA256_Update( &_context, p, (CC_LONG)n );
+		}
+	}
+
+	ContentDigest final()
+	{
+		ContentDigest digest;
+		CC_SHA256_Final( digest.bytes, &_context );
+		return digest;
+	}
+
+private:
+	CC_SHA256_CTX _context;
+};
+
+ContentDigest digestContent( const void *i_data, size_t i_size )
+{
+	Digest digest;
+	digest.update( i_data, i_size );
+	return digest.final();
+}
+
+// Unlinked temporary file holding the large stream bodies, mapped in memory.
+// Their pages are written back to the file under memory pressure instead of
+// staying resident, so the memory use of the jobs doesn't grow with the size
+// of the images.  Shared by the documents of a run.
+class SpillFile
+{
+public:
+	SpillFile( size_t i_threshold, const std::string &i_dir )
+		: _threshold( std::max<size_t>( i_threshold, 1 ) )
+	{
+		std::string path = i_dir + "/pdf2text-spill-XXXXXX";
+		_fd = mkstemp( &path[0] );
+		if ( _fd == -1 )
+			throw std::runtime_error( "cannot create spill file" );
+		unlink( path.c_str() );
+	}
+	~SpillFile() { close( _fd ); }
+
+	SpillFile( const SpillFile & ) = delete;
+	SpillFile &operator=( const SpillFile & ) = delete;
+
+	// Map i_size bytes at a new offset of the file, null for the sizes below
+	// the threshold that stay on the heap.
+	char *map( size_t i_size, off_t &o_offset, size_t &o_size )
+	{
+		if ( i_size < _threshold )
+			return nullptr;
+		static const size_t page = sysconf( _SC_PAGESIZE );
+		o_size = ( i_size + page - 1 ) / page * page;
+		{
+			std::lock_guard<std::mutex> lock( _mutex );
+			o_offset = _end;
+			if ( ftruncate( _fd, _end + o_size ) != 0 )
+				throw std::runtime_error( "cannot extend spill file" );
+			_end += o_size;
+		}
+		void *data = mmap( nullptr, o_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+						   _fd, o_offset );
+		if ( data == MAP_FAILED )
+			throw std::runtime_error( "cannot map spill file" );
+		return (char *)data;
+	}
+
+	// unmap a body and give its blocks back to the file system
+	void unmap( char *i_data, off_t i_offset, size_t i_size )
+	{
+		munmap( i_data, i_size );
+#if defined( FALLOC_FL_PUNCH_HOLE )
+		fallocate( _fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, i_offset,
+				   i_size );
+#elif defined( F_PUNCHHOLE )
+		fpunchhole_t hole{0, 0, i_offset, (off_t)i_size};
+		fcntl( _fd, F_PUNCHHOLE, &hole );
+#endif
+	}
+
+private:
+	const size_t _threshold;
+	int _fd;
+	std::mutex _mutex;
+	off_t _end{0};
+};
+
+// stream body, on the heap or mapped from the spill file
+struct ConvData
+{
+	struct Deleter
+	{
+		void operator()( char *i_data ) const
+		{
+			if ( spill != nullptr )
+				spill->unmap( i_data, offset, size );
+			else
+				delete[] i_data;
+		}
+		SpillFile *spill;
+		off_t offset;
+		size_t size;
+	};
+
+	void allocate( size_t i_size, SpillFile *i_spill )
+	{
+		Deleter deleter{};
+		char *p = i_spill != nullptr
+					  ? i_spill->map( i_size, deleter.offset, deleter.size )
+					  : nullptr;
+		if ( p != nullptr )
+			deleter.spill = i_spill;
+		else
+			p = new char[i_size];
+		data = std::unique_ptr<char[], Deleter>( p, deleter );
+	}
+
+	size_t size;
+	std::unique_ptr<char[], Deleter> data;
+};
+ConvData convertBytes( const UInt8 *ptr, size_t l, encoding_t encoding,
+					   SpillFile *spill )
+{
+	ConvData cd;
+	cd.size = encoding == encoding_hex		 ? hexEncodedSize( l )
+			  : encoding == encoding_ascii85 ? ascii85EncodedSize( l )
+											 : l;
+	cd.allocate( cd.size, spill );
+	if ( encoding == encoding_none )
+	{
+		memcpy( cd.data.get(), ptr, cd.size );
+		return cd;
+	}
+
+	auto end = encodeSlice( encoding, ptr, l, cd.data.get() );
+	auto marker = encodedEnd( encoding );
+	end = std::copy( marker, marker + strlen( marker ), end );
+	assert( end == cd.data.get() + cd.size );
+	return cd;
+}
+
+ConvData convertData( CFDataRef data, encoding_t encoding, SpillFile *spill )
+{
+	return convertBytes( CFDataGetBytePtr( data ), CFDataGetLength( data ),
+						 encoding, spill );
+}
+
+// compress the data with zlib, as read by FlateDecode
+ConvData deflateBytes( const UInt8 *ptr, size_t l, int level, SpillFile *spill )
+{
+	ConvData cd;
+	uLongf size = compressBound( l );
+	cd.allocate( size, spill );
+	if ( compress2( (Bytef *)cd.data.get(), &size, ptr, l, level ) != Z_OK )
+		throw std::runtime_error( "cannot compress stream" );
+	cd.size = size;
+	return cd;
+}
+
+ConvData deflateData( CFDataRef data, int level, SpillFile *spill )
+{
+	return deflateBytes( CFDataGetBytePtr( data ), CFDataGetLength( data ),
+						 level, spill );
+}
+
+// Digest of each stream of an output and where it was written, from the start
+// of its dictionary to the end of "endstream".  Saved next to the output for
+// the next incremental conversion.
+struct Manifest
+{
+	struct Span
+	{
+		uint64_t offset, size;
+	};
+
+	// false if the file is missing or not a manifest
+	bool read( const std::string &i_path )
+	{
+		std::ifstream file( i_path );
+		std::string header;
+		if ( not std::getline( file, header ) or header != kHeader )
+			return false;
+		std::string hex;
+		Span span;
+		while ( file >> hex >> span.offset >> span.size )
+		{
+			ContentDigest digest;
+			if ( not digest.fromHex( hex ) )
+				return false;
+			streams[digest] = span;
+		}
+		return file.eof();
+	}
+
+	void write( const std::string &i_path ) const
+	{
+		std::ofstream file( i_path );
+		file << kHeader << "\n";
+		for ( auto &it : streams )
+			file << it.first.hex() << " " << it.second.offset << " "
+				 << it.second.size << "\n";
+		if ( not file.flush() )
+			throw std::runtime_error( "cannot write manifest" );
+	}
+
+	static const char *const kHeader;
+	std::map<ContentDigest, Span> streams;
+};
+const char *const Manifest::kHeader = "%pdf2text-manifest 2";
+
+// stream body converted ahead of time by a worker
+struct EncodedStream
+{
+	CGPDFDataFormat format;
+	encoding_t encoding;
+	// body compressed before its encoding
+	bool flate;
+	// content stream pretty printed
+	bool pretty;
+	std::shared_ptr<const ConvData> body;
+	// in an incremental conversion, the identity of the stream output and,
+	// when it is unchanged, its place in the previous output instead of body
+	ContentDigest hash;
+	const Manifest::Span *unchanged{nullptr};
+};
+
+// Encoded stream bodies shared by the documents of a run, found by the digest
+// of their decoded data and the way they are encoded.  Beyond the memory budget
+// the least recently used bodies are dropped.  With a directory, the bodies
+// are also stored there as files and found again by later runs.
+class StreamCache
+{
+public:
+	struct Key
+	{
+		ContentDigest digest;
+		size_t size;
+		CGPDFDataFormat format;
+		encoding_t encoding;
+		bool flate;
+		int flateLevel;
+		bool pretty;
+
+		bool operator==( const Key &i_other ) const
+		{
+			return digest == i_other.digest and size == i_other.size and
+				   format == i_other.format and
+				   encoding == i_other.encoding and flate == i_other.flate and
+				   flateLevel == i_other.flateLevel and
+				   pretty == i_other.pretty;
+		}
+	};
+
+	// smaller streams are cheaper to encode again than to look up
+	static const size_t kMinSize = 4096;
+
+	StreamCache( size_t i_budget, const std::string &i_dir,
+				 SpillFile *i_spill )
+		: _budget( i_budget ), _dir( i_dir ), _spill( i_spill )
+	{
+	}
+
+	std::shared_ptr<const ConvData> find( const Key &i_key )
+	{
+		{
+			std::lock_guard<std::mutex> lock( _mutex );
+			auto it = _index.find( i_key );
+			if ( it != _index.end() )
+			{
+				// most recent first
+				_lru.splice( _lru.begin(), _lru, it->second );
+				return it->second->body;
+			}
+		}
+		if ( _dir.empty() )
+			return nullptr;
+		auto body = load( i_key );
+		if ( body != nullptr )
+			remember( i_key, body );
+		return body;
+	}
+
+	void insert( const Key &i_key, const std::shared_ptr<const ConvData> &i_body )
+	{
+		if ( remember( i_key, i_body ) and not _dir.empty() )
+			store( i_key, *i_body );
+	}
+
+private:
+	struct Entry
+	{
+		Key key;
+		std::shared_ptr<const ConvData> body;
+	};
+
+	struct KeyHash
+	{
+		size_t operator()( const Key &i_key ) const
+		{
+			size_t h;
+			memcpy( &h, i_key.digest.bytes, sizeof( h ) );
+			return h;
+		}
+	};
+
+	// memory counted for a body
+	static size_t cost( const ConvData &i_body )
+	{
+		return i_body.size + sizeof( Entry ) + 64;
+	}
+
+	// add a body in memory, false if it was already there
+	bool remember( const Key &i_key, const std::shared_ptr<const ConvData> &i_body )
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		if ( _index.find( i_key ) != _index.end() )
+			return false;
+		if ( cost( *i_body ) > _budget )
+			return true;
+		_lru.push_front( Entry{i_key, i_body} );
+		_index[i_key] = _lru.begin();
+		_used += cost( *i_body );
+		while ( _used > _budget )
+		{
+			auto &last = _lru.back();
+			_used -= cost( *last.body );
+			_index.erase( last.key );
+			_lru.pop_back();
+		}
+		return true;
+	}
+
+	std::string path( const Key &i_key ) const
+	{
+		char name[64];
+		snprintf( name, sizeof( name ), "-%zx-%d-%d-%d%s", i_key.size,
+				  (int)i_key.format, (int)i_key.encoding,
+				  i_key.flate ? i_key.flateLevel : -2,
+				  i_key.pretty ? "-p" : "" );
+		return _dir + "/" + i_key.digest.hex() + name;
+	}
+
+	std::shared_ptr<const ConvData> load( const Key &i_key ) const
+	{
+		std::ifstream file( path( i_key ), std::ios::binary | std::ios::ate );
+		if ( not file )
+			return nullptr;
+		auto body = std::make_shared<ConvData>();
+		body->size = (size_t)file.tellg();
+		body->allocate( body->size, _spill );
+		file.seekg( 0 );
+		if ( not file.read( body->data.get(), body->size ) )
+			return nullptr;
+		return body;
+	}
+
+	// The file is written under a temporary name and renamed, so concurrent
+	// runs never see a partial body.  Failures only cost a future encoding.
+	void store( const Key &i_key, const ConvData &i_body ) const
+	{
+		std::string tmp = _dir + "/.tmp-XXXXXX";
+		int fd = mkstemp( &tmp[0] );
+		if ( fd < 0 )
+			return;
+		bool ok = true;
+		for ( size_t done = 0; ok and done < i_body.size; )
+		{
+			auto n = write( fd, i_body.data.get() + done, i_body.size - done );
+			ok = n > 0;
+			done += ok ? n : 0;
+		}
+		ok = close( fd ) == 0 and ok;
+		if ( not ok or rename( tmp.c_str(), path( i_key ).c_str() ) != 0 )
+			std::remove( tmp.c_str() );
+	}
+
+	const size_t _budget;
+	const std::string _dir;
+	// for the bodies loaded from _dir
+	SpillFile *const _spill;
+	std::mutex _mutex;
+	std::list<Entry> _lru;
+	std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> _index;
+	size_t _used{0};
+};
+const size_t StreamCache::kMinSize;
+
+// Incremental conversion of a document.  The streams found in the manifest
+// of the previous output are copied from it instead of being encoded again,
+// and the manifest of the new output is built.
+class Incremental
+{
+public:
+	Incremental() = default;
+	Incremental( const Incremental & ) = delete;
+	Incremental &operator=( const Incremental & ) = delete;
+
+	~Incremental()
+	{
+		if ( _previousFd >= 0 )
+			close( _previousFd );
+	}
+
+	// use the previous output at i_path, if it has a manifest
+	void open( const std::string &i_path )
+	{
+		if ( _previous.read( i_path + ".manifest" ) )
+			_previousFd = ::open( i_path.c_str(), O_RDONLY );
+	}
+
+	// where the stream was written in the previous output, or null
+	const Manifest::Span *previousSpan( const ContentDigest &i_hash ) const
+	{
+		if ( _previousFd < 0 )
+			return nullptr;
+		auto it = _previous.streams.find( i_hash );
+		return it != _previous.streams.end() ? &it->second : nullptr;
+	}
+
+	// copy a stream from the previous output
+	void copy( OutputSink &s, const Manifest::Span &i_span ) const
+	{
+		for ( uint64_t done = 0; done < i_span.size; )
+		{
+			size_t n = (size_t)std::min<uint64_t>( s.maxReserve(),
+												   i_span.size - done );
+			auto buffer = s.reserve( n );
+			auto read = pread( _previousFd, buffer, n, i_span.offset + done );
+			if ( read <= 0 )
+				throw std::runtime_error( "cannot read previous output" );
+			s.commit( read );
+			done += read;
+		}
+	}
+
+	Manifest &current() { return _current; }
+
+private:
+	int _previousFd{-1};
+	Manifest _previous, _current;
+};
+
+// how the decoded body of stream is written
+encoding_t streamEncoding( const PDFStream *stream, CGPDFDataFormat format,
+						   CFDataRef data, const SaveOptions &options )
+{
+	auto type = stream->dict()->value( sym_Type );
+	if ( type != nullptr and type->type() == PDFObject::type_name and
+		 type->asName()->symbol() == sym_Metadata )
+		return encoding_none;
+	if ( stream->outputAsText )
+		return encoding_none;
+	// streams already made of text are written as they are
+	if ( format == CGPDFDataFormatRaw and
+		 isTextData( CFDataGetBytePtr( data ), CFDataGetLength( data ) ) )
+		return encoding_none;
+	return options.encoding;
+}
+
+// Pretty printer of the content streams, with prettyContents: the stream is
+// tokenized in one pass and written back one operator per line after its
+// operands, with the numbers normalized and the lines indented by the q/Q,
+// BT/ET and marked content nesting.  Strings, names and inline images are
+// copied as they are.  Nothing is allocated but the text.
+class ContentPrinter
+{
+public:
+	// io_counts has kContentOperatorCount + 1 entries
+	ContentPrinter( std::string &o_text, size_t *io_counts )
+		: _text( o_text ), _counts( io_counts )
+	{
+	}
+
+	// false on a syntax error, the stream is then left as it is
+	bool run( const UInt8 *i_data, size_t i_size )
+	{
+		_text.reserve( i_size + i_size / 4 );
+		auto p = i_data, end = i_data + i_size;
+		for ( ;; )
+		{
+			while ( p < end and isSpace( *p ) )
+				++p;
+			if ( p == end )
+				break;
+			auto start = p;
+			switch ( *p )
+			{
+				case '%':
+					while ( p < end and *p != '\n' and *p != '\r' )
+						++p;
+					token( start, p - start, false );
+					endLine();
+					continue;
+				case '(':
+					// balanced parentheses but the escaped ones
+					for ( size_t nesting = 0; p < end; ++p )
+					{
+						if ( *p == '\\' and p + 1 < end )
+							++p;
+						else if ( *p == '(' )
+							++nesting;
+						else if ( *p == ')' and --nesting == 0 )
+							break;
+					}
+					if ( p == end )
+						return false;
+					token( start, ++p - start, false );
+					continue;
+				case '<':
+					if ( p + 1 < end and p[1] == '<' )
+						break;
+					for ( ++p; p < end and *p != '>'; ++p )
+					{
+						if ( not isxdigit( *p ) and not isSpace( *p ) )
+							return false;
+					}
+					if ( p == end )
+						return false;
+					token( start, ++p - start, false );
+					continue;
+				case '>':
+					if ( p + 1 < end and p[1] == '>' )
+						break;
+					return false;
+				case '[':
+				case ']':
+					token( start, 1, *p == ']' );
+					_open = *p++ == '[';
+					continue;
+				case ')':
+				case '{':
+				case '}':
+					return false;
+				case '/':
+					for ( ++p; p < end and isRegular( *p ); ++p )
+						;
+					token( start, p - start, false );
+					continue;
+				default:
+					break;
+			}
+			if ( *p == '<' or *p == '>' )
+			{
+				p += 2;
+				token( start, 2, false );
+				continue;
+			}
+
+			while ( p < end and isRegular( *p ) )
+				++p;
+			size_t size = p - start;
+			if ( isdigit( *start ) or *start == '+' or *start == '-' or
+				 *start == '.' )
+			{
+				if ( not number( start, size ) )
+					return false;
+			}
+			else if ( keyword( start, size, "true" ) or
+					  keyword( start, size, "false" ) or
+					  keyword( start, size, "null" ) )
+				token( start, size, false );
+			else if ( keyword( start, size, "ID" ) and _image )
+			{
+				if ( not imageData( p, end ) )
+					return false;
+			}
+			else
+				op( start, size );
+		}
+		endLine();
+		return true;
+	}
+
+private:
+	static const size_t kMaxIndent = 16;
+
+	static bool isSpace( UInt8 c )
+	{
+		return c == ' ' or c == '\n' or c == '\r' or c == '\t' or c == '\f' or
+			   c == 0;
+	}
+	static bool isRegular( UInt8 c )
+	{
+		switch ( c )
+		{
+			case '(':
+			case ')':
+			case '<':
+			case '>':
+			case '[':
+			case ']':
+			case '{':
+			case '}':
+			case '/':
+			case '%':
+				return false;
+			default:
+				return not isSpace( c );
+		}
+	}
+	static bool keyword( const UInt8 *i_token, size_t i_size, const char *i_word )
+	{
+		return i_size == strlen( i_word ) and
+			   memcmp( i_token, i_word, i_size ) == 0;
+	}
+
+	// separate a token from the previous one, or indent a new line
+	void token( const UInt8 *i_token, size_t i_size, bool i_close )
+	{
+		if ( not _pending )
+			_text.append( 2 * std::min( _depth, kMaxIndent ), ' ' );
+		else if ( not _open and not i_close )
+			_text += ' ';
+		_text.append( (const char *)i_token, i_size );
+		_pending = true;
+		_open = false;
+	}
+
+	void endLine()
+	{
+		if ( _pending )
+			_text += '\n';
+		_pending = false;
+		_open = false;
+	}
+
+	// sign, integer part without leading zeros, fraction without trailing
+	// zeros, like 0.5 for +.50
+	bool number( const UInt8 *i_token, size_t i_size )
+	{
+		size_t i = 0;
+		bool negative = i_token[0] == '-';
+		if ( i_token[0] == '+' or i_token[0] == '-' )
+			++i;
+		size_t intBegin = i;
+		while ( i < i_size and isdigit( i_token[i] ) )
+			++i;
+		size_t intEnd = i, fracBegin = i, fracEnd = i;
+		if ( i < i_size and i_token[i] == '.' )
+		{
+			fracBegin = ++i;
+			while ( i < i_size and isdigit( i_token[i] ) )
+				++i;
+			fracEnd = i;
+		}
+		if ( i != i_size or ( intBegin == intEnd and fracBegin == fracEnd ) )
+			return false;
+		while ( intBegin < intEnd and i_token[intBegin] == '0' )
+			++intBegin;
+		while ( fracEnd > fracBegin and i_token[fracEnd - 1] == '0' )
+			--fracEnd;
+
+		char buffer[24];
+		size_t n = 0;
+		if ( negative and ( intBegin < intEnd or fracBegin < fracEnd ) )
+			buffer[n++] = '-';
+		if ( intBegin == intEnd )
+			buffer[n++] = '0';
+		// long numbers are rare, they are written in pieces
+		token( (const UInt8 *)buffer, n, false );
+		_text.append( (const char *)i_token + intBegin, intEnd - intBegin );
+		if ( fracBegin < fracEnd )
+		{
+			_text += '.';
+			_text.append( (const char *)i_token + fracBegin,
+						  fracEnd - fracBegin );
+		}
+		return true;
+	}
+
+	void op( const UInt8 *i_op, size_t i_size )
+	{
+		++_counts[ContentOperator( (const char *)i_op, i_size )];
+		bool opens = keyword( i_op, i_size, "q" ) or
+					 keyword( i_op, i_size, "BT" ) or
+					 keyword( i_op, i_size, "BMC" ) or
+					 keyword( i_op, i_size, "BDC" );
+		bool closes = keyword( i_op, i_size, "Q" ) or
+					  keyword( i_op, i_size, "ET" ) or
+					  keyword( i_op, i_size, "EMC" );
+		if ( closes and _depth > 0 and not _pending )
+			--_depth;
+		token( i_op, i_size, false );
+		// the inline image dictionary follows on the same line
+		if ( keyword( i_op, i_size, "BI" ) )
+		{
+			_image = true;
+			return;
+		}
+		endLine();
+		if ( opens )
+			++_depth;
+	}
+
+	// Copy the data of an inline image, from the whitespace after ID to EI
+	// preceded by a whitespace and followed by a delimiter.
+	bool imageData( const UInt8 *&io_p, const UInt8 *i_end )
+	{
+		if ( io_p == i_end or not isSpace( *io_p ) )
+			return false;
+		auto q = io_p + 1;
+		for ( ; q + 2 <= i_end; ++q )
+		{
+			if ( q[0] == 'E' and q[1] == 'I' and isSpace( q[-1] ) and
+				 ( q + 2 == i_end or not isRegular( q[2] ) ) )
+				break;
+		}
+		if ( q + 2 > i_end )
+			return false;
+		++_counts[ContentOperator( "ID", 2 )];
+		++_counts[ContentOperator( "EI", 2 )];
+		token( (const UInt8 *)"ID", 2, false );
+		_text.append( (const char *)io_p, q - io_p );
+		_text += "EI";
+		endLine();
+		_image = false;
+		io_p = q + 2;
+		return true;
+	}
+
+	std::string &_text;
+	size_t *_counts;
+	size_t _depth{0};
+	// a line is started, after [
+	bool _pending{false}, _open{false};
+	// in the dictionary of an inline image
+	bool _image{false};
+};
+
+// whether the decoded body of stream is compressed before being written
+bool deflateStream( const PDFStream *stream, CGPDFDataFormat format,
+					const SaveOptions &options )
+{
+	if ( not options.flate or format != CGPDFDataFormatRaw )
+		return false;
+	// left readable, as for the encoding
+	auto type = stream->dict()->value( sym_Type );
+	return type == nullptr or type->type() != PDFObject::type_name or
+		   type->asName()->symbol() != sym_Metadata;
+}
+
+// Byte statistics of a body for the optimize policies, from samples: its
+// first and last kEdge bytes and kSlices slices of kSlice bytes in between,
+// so a large body is never read whole.  They only estimate the costs of
+// optimize_size, a body is written as text after isTextData() checked all of
+// it.
+struct StreamProfile
+{
+	static const size_t kEdge = 4096;
+	static const size_t kSlices = 16;
+	static const size_t kSlice = 256;
+
+	StreamProfile( const UInt8 *i_data, size_t i_size )
+	{
+		size_t histogram[256] = {};
+		auto add = [&histogram]( const UInt8 *i_p, size_t i_n ) {
+			for ( size_t i = 0; i < i_n; ++i )
+				++histogram[i_p[i]];
+		};
+		if ( i_size <= 2 * kEdge + kSlices * kSlice )
+			add( i_data, i_size );
+		else
+		{
+			add( i_data, kEdge );
+			add( i_data + i_size - kEdge, kEdge );
+			size_t stride = ( i_size - 2 * kEdge ) / kSlices;
+			for ( size_t i = 0; i < kSlices; ++i )
+				add( i_data + kEdge + i * stride, kSlice );
+		}
+
+		for ( int c = 0; c < 256; ++c )
+		{
+			sampled += histogram[c];
+			if ( not kTextBytes.text[c] )
+				binary += histogram[c];
+		}
+		size_t distinct = 0;
+		for ( int c = 0; c < 256 and sampled > 0; ++c )
+		{
+			if ( histogram[c] == 0 )
+				continue;
+			double p = (double)histogram[c] / sampled;
+			entropy -= p * std::log2( p );
+			++distinct;
+		}
+		// a small sample looks more ordered than the data, correct it
+		if ( sampled > 0 )
+			entropy = std::min( 8.0, entropy + ( distinct - 1 ) /
+											   ( 2 * sampled * std::log( 2.0 ) ) );
+	}
+
+	// no binary byte sampled, the body may still have some elsewhere
+	bool text() const { return binary == 0; }
+	// expected size after flate, the order 0 entropy in bits per byte over 8
+	double flateRatio() const { return entropy / 8; }
+
+	size_t sampled{0};
+	// bytes that are not text
+	size_t binary{0};
+	double entropy{0};
+};
+
+// how a body is written
+struct StreamStrategy
+{
+	encoding_t encoding;
+	// compressed before its encoding
+	bool flate;
+};
+
+// Choose how a body is written, from encoding and flate, or for the optimize
+// policy of the options.  JPEG and JPEG2000 bodies are never compressed again
+// and stay wrapped in their filter.
+StreamStrategy streamStrategy( const PDFStream *stream, CGPDFDataFormat format,
+							   CFDataRef data, const SaveOptions &options )
+{
+	if ( options.optimize == optimize_none )
+	{
+		bool flate = deflateStream( stream, format, options );
+		// compressed data is binary whatever the stream held
+		return StreamStrategy{
+			flate ? options.encoding
+				  : streamEncoding( stream, format, data, options ),
+			flate};
+	}
+
+	auto type = stream->dict()->value( sym_Type );
+	if ( type != nullptr and type->type() == PDFObject::type_name and
+		 type->asName()->symbol() == sym_Metadata )
+		return StreamStrategy{encoding_none, false};
+	bool raw = format == CGPDFDataFormatRaw;
+	auto ptr = CFDataGetBytePtr( data );
+	size_t size = CFDataGetLength( data );
+	switch ( options.optimize )
+	{
+		case optimize_editable:
+			// the whole body is checked as it is meant to be edited
+			return StreamStrategy{raw and ( stream->outputAsText or
+											isTextData( ptr, size ) )
+									  ? encoding_none
+									  : encoding_hex,
+								  false};
+		case optimize_speed:
+			// no compression nor scan, and the fastest encoding kernel
+			return StreamStrategy{
+				raw and stream->outputAsText ? encoding_none : encoding_hex,
+				false};
+		default:
+			break;
+	}
+
+	// smallest ASCII output, from the expected sizes with their filters: text
+	// as is, ascii85, or compressed in ascii85
+	if ( not raw )
+		return StreamStrategy{encoding_ascii85, false};
+	StreamProfile profile( ptr, size );
+	bool text = stream->outputAsText or
+				( profile.text() and isTextData( ptr, size ) );
+	double ascii85 = 1.25 * size + 24;
+	double compressed = 1.25 * ( profile.flateRatio() * size + 16 ) + 40;
+	if ( compressed < ascii85 and ( not text or compressed < size ) )
+		return StreamStrategy{encoding_ascii85, true};
+	return StreamStrategy{text ? encoding_none : encoding_ascii85, false};
+}
+
+// Add what WriteObject() writes for a direct object, or the reference, to
+// i_digest.  Each value starts with its type and containers and strings with
+// their size, so different objects never add the same bytes.
+void digestWritten( Digest &i_digest, const PDFObject *obj )
+{
+	auto add = [&i_digest]( uint64_t i_value ) {
+		i_digest.update( &i_value, sizeof( i_value ) );
+	};
+	auto addBytes = [&]( const ArenaString &i_s ) {
+		add( i_s.size() );
+		i_digest.update( i_s.data(), i_s.size() );
+	};
+	if ( obj->indirect() )
+	{
+		add( 1 );
+		add( (uint64_t)obj->getID() );
+		return;
+	}
+	add( 2 + obj->type() );
+	switch ( obj->type() )
+	{
+		case PDFObject::type_boolean:
+			add( obj->asBoolean()->value() );
+			break;
+		case PDFObject::type_number:
+		{
+			auto num = obj->asNumber();
+			add( num->isInt() );
+			if ( num->isInt() )
+				add( (uint64_t)(int64_t)num->intValue() );
+			else
+			{
+				double v = num->realValue();
+				i_digest.update( &v, sizeof( v ) );
+			}
+			break;
+		}
+		case PDFObject::type_string:
+			addBytes( obj->asString()->value() );
+			break;
+		case PDFObject::type_name:
+			addBytes( obj->asName()->value() );
+			break;
+		case PDFObject::type_array:
+		{
+			auto array = obj->asArray();
+			add( array->count() );
+			for ( size_t i = 0; i < array->count(); ++i )
+				digestWritten( i_digest, array->value( i ) );
+			break;
+		}
+		case PDFObject::type_dict:
+		{
+			// inlined
+			auto dict = obj->asDictionary();
+			add( dict->count() );
+			for ( size_t i = 0; i < dict->count(); ++i )
+			{
+				ArenaString key;
+				auto value = dict->value( i, key );
+				addBytes( key );
+				digestWritten( i_digest, value );
+			}
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+// Identity of what WriteStream() writes for the stream: the decoded data,
+// the way it is encoded, and the dictionary with the IDs it refers to.  A
+// SHA-256, the previous output is copied when it matches.
+ContentDigest streamHash( const PDFStream *stream, CFDataRef data,
+						  const EncodedStream &encoded,
+						  const SaveOptions &options )
+{
+	Digest digest;
+	uint64_t header[] = {(uint64_t)CFDataGetLength( data ),
+						 ( (uint64_t)encoded.format << 32 ) |
+							 ( (uint64_t)encoded.encoding << 16 ) |
+							 ( encoded.pretty ? 0x1000 : 0 ) |
+							 ( encoded.flate ? 0x100 + options.flateLevel : 0 )};
+	digest.update( header, sizeof( header ) );
+	digest.update( CFDataGetBytePtr( data ), CFDataGetLength( data ) );
+	auto dict = stream->dict();
+	uint64_t count = dict->count();
+	digest.update( &count, sizeof( count ) );
+	for ( size_t i = 0; i < dict->count(); ++i )
+	{
+		ArenaString key;
+		auto value = dict->value( i, key );
+		uint64_t size = key.size();
+		digest.update( &size, sizeof( size ) );
+		digest.update( key.data(), key.size() );
+		// the length is the one of the output
+		if ( dict->key( i ) != sym_Length )
+			digestWritten( digest, value );
+	}
+	return digest.final();
+}
+
+EncodedStream EncodeStream( const PDFStream *stream, std::mutex &decodeMutex,
+							const SaveOptions &options,
+							const Incremental *incremental )
+{
+	EncodedStream encoded;
+	CFDataRef data;
+	{
+		// don't assume CoreGraphics can decode a document from several threads
+		std::lock_guard<std::mutex> lock( decodeMutex );
+		Stats::Timer timer( options.stats, Stats::phase_decode );
+		data = stream->copyData( encoded.format );
+	}
+	struct Release
+	{
+		~Release() { CFRelease( data ); }
+		CFDataRef data;
+	} release{data};
+	if ( options.stats != nullptr )
+		options.stats->decoded( CFDataGetLength( data ) );
+	Stats::Timer timer( options.stats, Stats::phase_encode );
+
+	auto strategy = streamStrategy( stream, encoded.format, data, options );
+	encoded.flate = strategy.flate;
+	encoded.encoding = strategy.encoding;
+	encoded.pretty = options.prettyContents and stream->contents and
+					 encoded.format == CGPDFDataFormatRaw;
+
+	if ( incremental != nullptr )
+	{
+		encoded.hash = streamHash( stream, data, encoded, options );
+		encoded.unchanged = incremental->previousSpan( encoded.hash );
+		if ( encoded.unchanged != nullptr )
+			return encoded;
+	}
+
+	size_t size = CFDataGetLength( data );
+	bool cached = options.cache != nullptr and size >= StreamCache::kMinSize;
+	StreamCache::Key key;
+	if ( cached )
+	{
+		key = StreamCache::Key{
+			digestContent( CFDataGetBytePtr( data ), size ), size,
+			encoded.format, encoded.encoding, encoded.flate,
+			options.flateLevel, encoded.pretty};
+		encoded.body = options.cache->find( key );
+		if ( encoded.body != nullptr )
+			return encoded;
+	}
+
+	auto ptr = CFDataGetBytePtr( data );
+	std::string text;
+	if ( encoded.pretty )
+	{
+		size_t counts[kContentOperatorCount + 1] = {};
+		if ( ContentPrinter( text, counts ).run( ptr, size ) )
+		{
+			ptr = (const UInt8 *)text.data();
+			size = text.size();
+			if ( options.stats != nullptr )
+				options.stats->operators( counts );
+		}
+	}
+
+	if ( encoded.flate )
+	{
+		auto compressed =
+			deflateBytes( ptr, size, options.flateLevel, options.spill );
+		if ( encoded.encoding == encoding_none )
+			encoded.body = std::make_shared<ConvData>( std::move( compressed ) );
+		else
+			encoded.body = std::make_shared<ConvData>(
+				convertBytes( (const UInt8 *)compressed.data.get(),
+							  compressed.size, encoded.encoding,
+							  options.spill ) );
+	}
+	else
+		encoded.body = std::make_shared<ConvData>(
+			convertBytes( ptr, size, encoded.encoding, options.spill ) );
+
+	if ( cached )
+		options.cache->insert( key, encoded.body );
+	if ( options.stats != nullptr )
+		options.stats->encoded( encoded.body->size );
+	return encoded;
+}
+
+// write the filters decoding a body, the first one applied first
+void writeFilters( OutputSink &s, CGPDFDataFormat format, encoding_t encoding,
+				   bool flate )
+{
+	const char *filters[2];
+	size_t filterCount = 0;
+	if ( encoding == encoding_hex )
+		filters[filterCount++] = "/ASCIIHexDecode";
+	else if ( encoding == encoding_ascii85 )
+		filters[filterCount++] = "/ASCII85Decode";
+	if ( flate )
+		filters[filterCount++] = "/FlateDecode";
+	else if ( format == CGPDFDataFormatJPEGEncoded )
+		filters[filterCount++] = "/DCTDecode";
+	else if ( format == CGPDFDataFormatJPEG2000 )
+		filters[filterCount++] = "/JPXDecode";
+	if ( filterCount == 1 )
+		s << "/Filter " << filters[0] << "\n";
+	else if ( filterCount == 2 )
+		s << "/Filter [" << filters[0] << " " << filters[1] << "]\n";
+}
+
+// Write the end of the dictionary and the body of a stream made by the
+// converter, like an object stream.  It is compressed and encoded as the
+// other streams, or left as is when it is text.
+void WriteMadeStream( OutputSink &s, const char *i_data, size_t i_size,
+					  bool i_binary, const SaveOptions &options )
+{
+	// the optimize policies as for a body of the same kind
+	bool flate = options.optimize == optimize_none
+					 ? options.flate
+					 : options.optimize == optimize_size;
+	encoding_t binaryEncoding =
+		options.optimize == optimize_none	 ? options.encoding
+		: options.optimize == optimize_size ? encoding_ascii85
+											 : encoding_hex;
+	encoding_t encoding = i_binary ? binaryEncoding : encoding_none;
+	ConvData body;
+	if ( flate )
+	{
+		auto compressed = deflateBytes( (const UInt8 *)i_data, i_size,
+										options.flateLevel, options.spill );
+		encoding = binaryEncoding;
+		body = convertBytes( (const UInt8 *)compressed.data.get(),
+							 compressed.size, encoding, options.spill );
+	}
+	else
+		body = convertBytes( (const UInt8 *)i_data, i_size, encoding,
+							 options.spill );
+	writeFilters( s, CGPDFDataFormatRaw, encoding, flate );
+	s << "/Length " << body.size << "\n";
+	s << ">>\nstream\n";
+	s.write( body.data.get(), body.size );
+	s << "\nendstream";
+}
+
+// write a stream, encoding it on the fly unless i_encoded is given
+void WriteStream( OutputSink &s, const PDFStream *stream,
+				  const SaveOptions &options, const EncodedStream *i_encoded )
+{
+	auto dict = stream->dict();
+	s << "<<\n";
+	CGPDFDataFormat format;
+	CFDataRef data = nullptr;
+	encoding_t encoding;
+	bool flate = false;
+	size_t size;
+	if ( i_encoded != nullptr )
+	{
+		format = i_encoded->format;
+		encoding = i_encoded->encoding;
+		flate = i_encoded->flate;
+		size = i_encoded->body->size;
+	}
+	else
+	{
+		Stats::Timer timer( options.stats, Stats::phase_decode );
+		data = stream->copyData( format );
+		// never compressed, those go through EncodeStream()
+		auto strategy = streamStrategy( stream, format, data, options );
+		assert( not strategy.flate );
+		encoding = strategy.encoding;
+		size = convertedSize( data, encoding );
+		if ( options.stats != nullptr )
+		{
+			options.stats->decoded( CFDataGetLength( data ) );
+			options.stats->encoded( size );
+		}
+	}
+
+	writeFilters( s, format, encoding, flate );
+	for ( size_t i = 0; i < dict->count(); ++i )
+	{
+		ArenaString name;
+		auto o = dict->value( i, name );
+		if ( dict->key( i ) == sym_Filter )
+		{
+			// skip
+		}
+		else if ( dict->key( i ) == sym_Length )
+		{
+			s << "/Length " << size << "\n";
+		}
+		else
+		{
+			writeName( s, name );
+			s << " ";
+			if ( o->indirect() )
+				s << o->getID() << " 0 R\n";
+			else
+			{
+				WriteObject( s, o );
+				s << "\n";
+			}
+		}
+	}
+	s << ">>\nstream\n";
+	if ( i_encoded != nullptr )
+		s.write( i_encoded->body->data.get(), i_encoded->body->size );
+	else
+	{
+		Stats::Timer timer( options.stats, Stats::phase_encode );
+		writeConvertedData( s, data, encoding );
+		CFRelease( data );
+	}
+	s << "\nendstream";
+}
+
+void WriteObject( OutputSink &s, const PDFObject *obj )
+{
+	switch ( obj->type() )
+	{
+		case PDFObject::type_boolean:
+			if ( obj->asBoolean()->value() )
+				s << "true ";
+			else
+				s << "false ";
+			break;
+		case PDFObject::type_number:
+			if ( obj->asNumber()->isInt() )
+				s << obj->asNumber()->intValue();
+			else
+				s << obj->asNumber()->realValue();
+			break;
+		case PDFObject::type_string:
+			s << "(" << obj->asString()->value() << ")";
+			break;
+		case PDFObject::type_name:
+			writeName( s, obj->asName()->value() );
+			break;
+		case PDFObject::type_array:
+			s << "[ ";
+			for ( size_t i = 0; i < obj->asArray()->count(); ++i )
+			{
+				auto o = obj->asArray()->value( i );
+				if ( o->indirect() )
+					s << o->getID() << " 0 R ";
+				else
+				{
+					WriteObject( s, o );
+					s << " ";
+				}
+			}
+			s << "]";
+			break;
+		case PDFObject::type_dict:
+		{
+			auto dict = obj->asDictionary();
+			s << "<<\n";
+			for ( size_t i = 0; i < dict->count(); ++i )
+			{
+				ArenaString name;
+				auto o = dict->value( i, name );
+				writeName( s, name );
+				s << " ";
+				if ( o->indirect() )
+					s << o->getID() << " 0 R\n";
+				else
+				{
+					WriteObject( s, o );
+					s << "\n";
+				}
+			}
+			s << ">>";
+			break;
+		}
+		case PDFObject::type_stream:
+			// always indirect, written by WriteStream()
+			assert( false );
+			break;
+		case PDFObject::type_null:
+			s << "null";
+			break;
+		default:
+			assert( false );
+			break;
+	}
+}
+
+// Object streams (PDF 1.5) packing the indirect objects that aren't streams,
+// kObjectsPerStream at most in each.  An object stream gets the next free ID
+// and is written where its last object would have been.
+class ObjectStreams
+{
+public:
+	static const size_t kObjectsPerStream = 100;
+
+	ObjectStreams( int i_firstID, const SaveOptions &i_options )
+		: _nextID( i_firstID ), _options( i_options ), _sink( _objects )
+	{
+	}
+
+	// pack obj in the current object stream, written to s once full
+	void add( OutputSink &s, const PDFObject *obj,
+			  std::map<int, XrefEntry> &xref )
+	{
+		if ( _offsets.empty() )
+			_id = _nextID++;
+		xref.insert( std::make_pair(
+			obj->getID(), XrefEntry{0, _id, _offsets.size() / 2} ) );
+		_offsets.push_back( obj->getID() );
+		_offsets.push_back( _sink.offset() - _start );
+		WriteObject( _sink, obj );
+		_sink << "\n";
+		if ( _offsets.size() / 2 == kObjectsPerStream )
+			flush( s, xref );
+	}
+
+	// write the current object stream, if any
+	void flush( OutputSink &s, std::map<int, XrefEntry> &xref )
+	{
+		if ( _offsets.empty() )
+			return;
+		_sink.finish();
+		_start = _sink.offset();
+		// pairs of object ID and offset from /First, then the objects
+		std::string data;
+		for ( auto it : _offsets )
+			data += std::to_string( it ) + " ";
+		data.back() = '\n';
+		size_t first = data.size();
+		data += _objects.str();
+		_objects.str( "" );
+
+		xref.insert( std::make_pair( _id, XrefEntry{s.offset(), 0, 0} ) );
+		s << _id << " 0 obj\n";
+		s << "<<\n/Type /ObjStm\n/N " << _offsets.size() / 2 << "\n/First "
+		  << first << "\n";
+		WriteMadeStream( s, data.data(), data.size(), false, _options );
+		s << "\nendobj\n";
+		_offsets.clear();
+	}
+
+private:
+	int _nextID;
+	const SaveOptions &_options;
+	// the current object stream
+	int _id{0};
+	std::vector<uint64_t> _offsets;
+	std::ostringstream _objects;
+	StreamSink _sink;
+	uint64_t _start{0};
+};
+
+// Write all the indirect objects in order and fill the xref.  With a pool,
+// stream bodies are encoded in parallel, at most options.window of them ahead
+// of the writer.
+void WriteObjects( OutputSink &s, const std::vector<PDFObject *> &objectList,
+				   const std::vector<size_t> &groups,
+				   std::map<int, XrefEntry> &xref, const SaveOptions &options,
+				   WorkerPool *pool, Incremental *incremental )
+{
+	// the object streams come after all the objects
+	std::unique_ptr<ObjectStreams> objectStreams;
+	if ( options.objectStreams )
+		objectStreams.reset( new ObjectStreams(
+			1 + std::count_if( objectList.begin(), objectList.end(),
+							   []( const PDFObject *i_obj ) {
+								   return i_obj->indirect();
+							   } ),
+			options ) );
+
+	std::mutex decodeMutex;
+	std::deque<std::future<EncodedStream>> inFlight;
+	size_t next = 0;
+	auto schedule = [&] {
+		while ( inFlight.size() < std::max<size_t>( options.window, 1 ) and
+				next < objectList.size() )
+		{
+			auto stream = objectList[next++]->asStream();
+			if ( stream != nullptr )
+				inFlight.push_back(
+					pool->submit( [stream, &decodeMutex, &options, incremental] {
+						return EncodeStream( stream, decodeMutex, options,
+											 incremental );
+					} ) );
+		}
+	};
+
+	// the tasks refer to the objects, they must be done before leaving
+	struct Drain
+	{
+		~Drain()
+		{
+			for ( auto &it : inFlight )
+				it.wait();
+		}
+		std::deque<std::future<EncodedStream>> &inFlight;
+	} drain{inFlight};
+
+	// streams encoded before being written
+	auto writeEncoded = [&]( const PDFStream *stream,
+							 const EncodedStream &encoded ) {
+		auto start = s.offset();
+		if ( encoded.unchanged != nullptr )
+			incremental->copy( s, *encoded.unchanged );
+		else
+			WriteStream( s, stream, options, &encoded );
+		if ( incremental != nullptr )
+			incremental->current().streams[encoded.hash] =
+				Manifest::Span{start, s.offset() - start};
+	};
+
+	auto group = groups.begin();
+	for ( size_t i = 0; i < objectList.size(); ++i )
+	{
+		// a group is complete in the output before the next one
+		if ( group != groups.end() and *group == i )
+		{
+			if ( objectStreams != nullptr )
+				objectStreams->flush( s, xref );
+			if ( i > 0 )
+				s.flush();
+			++group;
+		}
+		auto current = objectList[i];
+		if ( pool != nullptr )
+			schedule();
+		if ( objectStreams != nullptr and current->indirect() and
+			 current->asStream() == nullptr )
+			objectStreams->add( s, current, xref );
+		else if ( current->indirect() )
+		{
+			xref.insert( std::make_pair(
+				current->getID(), XrefEntry{s.offset(), 0, 0} ) );
+			s << current->getID() << " 0 obj\n";
+			auto stream = current->asStream();
+			if ( pool != nullptr and stream != nullptr )
+			{
+				// popped first, the drain can't wait on a task that threw
+				auto task = std::move( inFlight.front() );
+				inFlight.pop_front();
+				auto encoded = task.get();
+				writeEncoded( stream, encoded );
+			}
+			else if ( stream != nullptr and
+					  ( options.flate or options.optimize == optimize_size or
+						options.cache != nullptr or incremental != nullptr or
+						( options.prettyContents and stream->contents ) ) )
+			{
+				// the compressed or printed size is only known once it is
+				// done, cached bodies are kept whole, and incremental ones are
+				// hashed first
+				writeEncoded( stream, EncodeStream( stream, decodeMutex,
+													options, incremental ) );
+			}
+			else if ( stream != nullptr )
+				WriteStream( s, stream, options, nullptr );
+			else
+				WriteObject( s, current );
+			s << "\nendobj\n";
+		}
+	}
+	if ( objectStreams != nullptr )
+		objectStreams->flush( s, xref );
+}
+
+// Write the xref stream (PDF 1.5) of the objects in xref, as the last object
+// and with the entries of the trailer.  Its entries are a type byte, 1 at an
+// offset or 2 in an object stream, the offset or the ID of the object stream,
+// and 2 bytes for the index in the object stream, big endian.
+void WriteXrefStream( OutputSink &s, std::map<int, XrefEntry> &xref,
+					  const PDFObject *i_root, const PDFObject *i_info,
+					  const SaveOptions &options )
+{
+	int id = (int)xref.size() + 1;
+	xref.insert( std::make_pair( id, XrefEntry{s.offset(), 0, 0} ) );
+	// IDs are from 1 without holes, the size of the offsets is enough
+	assert( xref.rbegin()->first == id );
+	size_t width = 1;
+	while ( width < 8 and s.offset() >> ( 8 * width ) != 0 )
+		++width;
+
+	std::string data;
+	data.reserve( ( id + 1 ) * ( width + 3 ) );
+	auto field = [&data]( uint64_t i_value, size_t i_size ) {
+		while ( i_size-- > 0 )
+			data.push_back( char( i_value >> ( 8 * i_size ) ) );
+	};
+	// the head of the free list
+	field( 0, 1 );
+	field( 0, width );
+	field( 0xFFFF, 2 );
+	for ( auto &it : xref )
+	{
+		bool packed = it.second.stream != 0;
+		field( packed ? 2 : 1, 1 );
+		field( packed ? it.second.stream : it.second.offset, width );
+		field( packed ? it.second.index : 0, 2 );
+	}
+
+	s << id << " 0 obj\n";
+	s << "<<\n/Type /XRef\n/Size " << id + 1 << "\n/W [1 " << width
+	  << " 2]\n/Root " << i_root->getID() << " 0 R\n/Info "
+	  << i_info->getID() << " 0 R\n";
+	WriteMadeStream( s, data.data(), data.size(), true, options );
+	s << "\nendobj\n";
+}
+
+// Content deduplication: streams whose output would be the same are collapsed
+// on a single object, and with i_containers dictionaries and arrays too.
+// Containers are compared after their elements, so elements are compared by
+// identity once they are collapsed.  On cycles, an element still being
+// compared is taken as it is, this may miss duplicates but never merges
+// different objects.  The objects identified by reference are never merged:
+// page tree nodes, annotations, form fields, tree nodes with a /Parent, and
+// the values of /Annots, /Fields and /Kids with their elements.
+class Deduplicator
+{
+public:
+	Deduplicator( std::vector<PDFObject *> &io_objectList, bool i_containers )
+		: _objectList( io_objectList ), _containers( i_containers )
+	{
+	}
+
+	void run( PDFObject *&io_root, PDFObject *&io_info )
+	{
+		_canonical.reserve( _objectList.size() );
+		io_root = collapse( io_root );
+		io_info = collapse( io_info );
+		recount( io_root, io_info );
+	}
+
+private:
+	// element of a container, the stream elements are the dictionary ones
+	static size_t elementCount( PDFObject *i_obj )
+	{
+		if ( auto array = i_obj->asArray() )
+			return array->count();
+		auto dict = i_obj->isStream() ? i_obj->asStream()->dict()
+									  : i_obj->asDictionary();
+		return dict != nullptr ? dict->count() : 0;
+	}
+
+	static PDFObject *element( PDFObject *i_obj, size_t i_index )
+	{
+		if ( auto array = i_obj->asArray() )
+			return array->valueAt( i_index );
+		auto dict = i_obj->isStream() ? i_obj->asStream()->dict()
+									  : i_obj->asDictionary();
+		return dict->valueAt( i_index );
+	}
+
+	static void setElement( PDFObject *i_obj, size_t i_index,
+							PDFObject *i_value )
+	{
+		if ( auto array = i_obj->asArray() )
+			return array->setValue( i_index, i_value );
+		auto dict = i_obj->isStream() ? i_obj->asStream()->dict()
+									  : i_obj->asDictionary();
+		dict->setValue( i_index, i_value );
+	}
+
+	static bool isContainer( const PDFObject *i_obj )
+	{
+		return i_obj->isArray() or i_obj->isDictionary() or i_obj->isStream();
+	}
+
+	// Collapse the containers reachable from i_obj, depth first with an
+	// explicit stack.  Returns the object replacing i_obj.
+	PDFObject *collapse( PDFObject *i_obj )
+	{
+		if ( not isContainer( i_obj ) )
+			return i_obj;
+		auto &slot = _canonical.findOrInsert( (PDFIdentifier)i_obj );
+		if ( slot != nullptr )
+			return slot;
+		slot = i_obj;
+
+		struct Frame
+		{
+			PDFObject *obj;
+			size_t next;
+			// the value of /Annots, /Fields or /Kids
+			bool list;
+		};
+		std::vector<Frame> stack;
+		stack.push_back( Frame{i_obj, 0, false} );
+		while ( not stack.empty() )
+		{
+			auto &frame = stack.back();
+			if ( frame.next < elementCount( frame.obj ) )
+			{
+				size_t i = frame.next++;
+				auto e = element( frame.obj, i );
+				if ( isContainer( e ) )
+				{
+					bool list = isListKey( frame.obj, i );
+					if ( list or frame.list )
+						_pinned.insert( e );
+					// until it is done, an element stands for itself
+					auto &canonical =
+						_canonical.findOrInsert( (PDFIdentifier)e );
+					if ( canonical == nullptr )
+					{
+						canonical = e;
+						stack.push_back( Frame{e, 0, list} );
+					}
+				}
+				continue;
+			}
+
+			auto obj = frame.obj;
+			stack.pop_back();
+			for ( size_t i = 0; i < elementCount( obj ); ++i )
+			{
+				auto e = element( obj, i );
+				if ( isContainer( e ) )
+					setElement(
+						obj, i, _canonical.findOrInsert( (PDFIdentifier)e ) );
+			}
+			auto canonical = findDuplicate( obj );
+			_canonical.findOrInsert( (PDFIdentifier)obj ) = canonical;
+		}
+		return _canonical.findOrInsert( (PDFIdentifier)i_obj );
+	}
+
+	// whether element i_index of a dictionary holds annotations or fields
+	static bool isListKey( const PDFObject *i_obj, size_t i_index )
+	{
+		auto dict = i_obj->asDictionary();
+		if ( dict == nullptr )
+			return false;
+		auto key = dict->key( i_index );
+		return key == sym_Annots or key == sym_Fields or key == sym_Kids;
+	}
+
+	// page tree nodes must stay a tree, annotations and fields are found by
+	// reference, like the nodes of the other trees
+	static bool hasIdentity( const PDFObject *i_obj )
+	{
+		auto dict = i_obj->asDictionary();
+		if ( dict == nullptr )
+			return false;
+		if ( dict->value( sym_FT ) != nullptr or
+			 dict->value( sym_Parent ) != nullptr )
+			return true;
+		auto type = dict->value( sym_Type );
+		return type != nullptr and type->isName() and
+			   ( type->asName()->symbol() == sym_Page or
+				 type->asName()->symbol() == sym_Pages or
+				 type->asName()->symbol() == sym_Annot );
+	}
+
+	// the object already seen with the same content, or i_obj
+	PDFObject *findDuplicate( PDFObject *i_obj )
+	{
+		if ( not i_obj->isStream() and not _containers )
+			return i_obj;
+		if ( hasIdentity( i_obj ) or _pinned.count( i_obj ) != 0 )
+			return i_obj;
+		uint64_t h = hashObject( i_obj );
+		auto range = _byHash.equal_range( h );
+		for ( auto it = range.first; it != range.second; ++it )
+		{
+			if ( sameObject( i_obj, it->second ) )
+				return it->second;
+		}
+		_byHash.insert( std::make_pair( h, i_obj ) );
+		return i_obj;
+	}
+
+	// hash of an element, containers by identity
+	static uint64_t hashValue( const PDFObject *i_obj )
+	{
+		switch ( i_obj->type() )
+		{
+			case PDFObject::type_boolean:
+				return hashMix( 1 + i_obj->asBoolean()->value() );
+			case PDFObject::type_number:
+			{
+				auto num = i_obj->asNumber();
+				if ( num->isInt() )
+					return hashMix( (uint64_t)(int64_t)num->intValue() );
+				double v = num->realValue();
+				return hashBytes( &v, sizeof( v ), 3 );
+			}
+			case PDFObject::type_string:
+			{
+				auto &v = i_obj->asString()->value();
+				return hashBytes( v.data(), v.size(), 5 );
+			}
+			case PDFObject::type_name:
+				return hashMix( ( (uint64_t)7 << 32 ) |
+								i_obj->asName()->symbol() );
+			case PDFObject::type_null:
+				return hashMix( 11 );
+			default:
+				return hashMix( (uint64_t)(uintptr_t)i_obj );
+		}
+	}
+
+	static bool sameValue( const PDFObject *a, const PDFObject *b )
+	{
+		if ( a == b )
+			return true;
+		if ( a->type() != b->type() )
+			return false;
+		switch ( a->type() )
+		{
+			case PDFObject::type_boolean:
+				return a->asBoolean()->value() == b->asBoolean()->value();
+			case PDFObject::type_number:
+			{
+				auto na = a->asNumber(), nb = b->asNumber();
+				if ( na->isInt() != nb->isInt() )
+					return false;
+				if ( na->isInt() )
+					return na->intValue() == nb->intValue();
+				double va = na->realValue(), vb = nb->realValue();
+				return memcmp( &va, &vb, sizeof( va ) ) == 0;
+			}
+			case PDFObject::type_string:
+			{
+				auto &va = a->asString()->value();
+				auto &vb = b->asString()->value();
+				return va.size() == vb.size() and
+					   memcmp( va.data(), vb.data(), va.size() ) == 0;
+			}
+			case PDFObject::type_name:
+				return a->asName()->symbol() == b->asName()->symbol();
+			case PDFObject::type_null:
+				return true;
+			default:
+				// containers are already collapsed
+				return false;
+		}
+	}
+
+	// entries rewritten when a stream is written are not compared
+	static bool comparedKey( Symbol i_key, bool i_stream )
+	{
+		return not i_stream or ( i_key != sym_Length and i_key != sym_Filter );
+	}
+
+	// independent of the order of the entries
+	static uint64_t hashEntries( const PDFDictionary *i_dict, bool i_stream )
+	{
+		uint64_t h = 0;
+		for ( size_t i = 0; i < i_dict->count(); ++i )
+		{
+			ArenaString key;
+			auto value = i_dict->value( i, key );
+			if ( comparedKey( i_dict->key( i ), i_stream ) )
+				h += hashMix( i_dict->key( i ) ^ hashValue( value ) );
+		}
+		return h;
+	}
+
+	static bool sameEntries( const PDFDictionary *a, const PDFDictionary *b,
+							 bool i_stream )
+	{
+		size_t count = 0;
+		for ( size_t i = 0; i < a->count(); ++i )
+		{
+			auto key = a->key( i );
+			if ( not comparedKey( key, i_stream ) )
+				continue;
+			++count;
+			ArenaString name;
+			auto other = b->value( key );
+			if ( other == nullptr or not sameValue( a->value( i, name ), other ) )
+				return false;
+		}
+		for ( size_t i = 0; i < b->count(); ++i )
+		{
+			if ( comparedKey( b->key( i ), i_stream ) )
+				--count;
+		}
+		return count == 0;
+	}
+
+	uint64_t hashObject( const PDFObject *i_obj )
+	{
+		if ( auto array = i_obj->asArray() )
+		{
+			uint64_t h = hashMix( 13 + array->count() );
+			for ( size_t i = 0; i < array->count(); ++i )
+				h = hashMix( h ^ hashValue( array->value( i ) ) );
+			return h;
+		}
+		if ( auto dict = i_obj->asDictionary() )
+			return hashMix( 17 + hashEntries( dict, false ) );
+
+		auto stream = i_obj->asStream();
+		CGPDFDataFormat format;
+		auto data = stream->copyData( format );
+		uint64_t h = hashBytes( CFDataGetBytePtr( data ),
+								CFDataGetLength( data ), format );
+		CFRelease( data );
+		return hashMix( h + hashEntries( stream->dict(), true ) );
+	}
+
+	static bool sameObject( const PDFObject *a, const PDFObject *b )
+	{
+		if ( a->type() != b->type() )
+			return false;
+		if ( auto array = a->asArray() )
+		{
+			auto other = b->asArray();
+			if ( array->count() != other->count() )
+				return false;
+			for ( size_t i = 0; i < array->count(); ++i )
+			{
+				if ( not sameValue( array->value( i ), other->value( i ) ) )
+					return false;
+			}
+			return true;
+		}
+		if ( auto dict = a->asDictionary() )
+			return sameEntries( dict, b->asDictionary(), false );
+
+		auto sa = a->asStream(), sb = b->asStream();
+		if ( not sameEntries( sa->dict(), sb->dict(), true ) )
+			return false;
+		// a hash match is confirmed on the data
+		CGPDFDataFormat fa, fb;
+		auto da = sa->copyData( fa );
+		CFDataRef db;
+		try
+		{
+			db = sb->copyData( fb );
+		}
+		catch ( ... )
+		{
+			CFRelease( da );
+			throw;
+		}
+		bool same = fa == fb and CFDataGetLength( da ) == CFDataGetLength( db ) and
+					memcmp( CFDataGetBytePtr( da ), CFDataGetBytePtr( db ),
+							CFDataGetLength( da ) ) == 0;
+		CFRelease( da );
+		CFRelease( db );
+		return same;
+	}
+
+	// Count again the references to the objects still reachable from the
+	// roots, and remove the others from the object list.
+	void recount( PDFObject *i_root, PDFObject *i_info )
+	{
+		for ( auto &it : _objectList )
+			it->setRefCount( 0 );
+
+		std::vector<PDFObject *> stack;
+		auto reference = [&stack]( PDFObject *i_obj ) {
+			if ( i_obj->refCount() == 0 and isContainer( i_obj ) )
+				stack.push_back( i_obj );
+			i_obj->inc();
+		};
+		reference( i_root );
+		reference( i_info );
+		while ( not stack.empty() )
+		{
+			auto obj = stack.back();
+			stack.pop_back();
+			for ( size_t i = 0; i < elementCount( obj ); ++i )
+				reference( element( obj, i ) );
+		}
+
+		_objectList.erase( std::remove_if( _objectList.begin(),
+										   _objectList.end(),
+										   []( const PDFObject *i_obj ) {
+											   return i_obj->refCount() == 0;
+										   } ),
+						   _objectList.end() );
+	}
+
+	std::vector<PDFObject *> &_objectList;
+	// merge the dictionaries and arrays, not only the streams
+	bool _containers;
+	// object replacing each container, itself until it is compared
+	VisitedMap _canonical;
+	std::unordered_multimap<uint64_t, PDFObject *> _byHash;
+	// never merged, from the key holding them
+	std::unordered_set<const PDFObject *> _pinned;
+};
+
+// Inlining of the dictionaries used once: they are written in the object
+// referring to them instead of as indirect objects.  The ones the spec wants
+// indirect stay so: the catalog, the info, the page tree, the outlines, and
+// the values of keys like /Parent or /Annots.  Elements of shared arrays are
+// left alone as the key holding them is not known.  Direct objects are written
+// recursively, so they are nested at most kMaxDepth deep.
+class Inliner
+{
+public:
+	static const size_t kMaxDepth = 32;
+
+	void run( PDFObject *i_root, PDFObject *i_info )
+	{
+		_seen.insert( i_root );
+		_seen.insert( i_info );
+		_stack.push_back( Item{i_root, 0, kUnknownKey} );
+		_stack.push_back( Item{i_info, 0, kUnknownKey} );
+		while ( not _stack.empty() )
+		{
+			auto item = _stack.back();
+			_stack.pop_back();
+			if ( auto array = item.obj->asArray() )
+			{
+				for ( size_t i = 0; i < array->count(); ++i )
+					reach( array->valueAt( i ), item.depth, item.key );
+				continue;
+			}
+			auto dict = item.obj->isStream() ? item.obj->asStream()->dict()
+											 : item.obj->asDictionary();
+			for ( size_t i = 0; dict != nullptr and i < dict->count(); ++i )
+				reach( dict->valueAt( i ), item.depth, dict->key( i ) );
+		}
+	}
+
+private:
+	static const Symbol kUnknownKey = Symbol( -1 );
+
+	// a container and the key holding it, kUnknownKey for indirect ones
+	struct Item
+	{
+		PDFObject *obj;
+		size_t depth;
+		Symbol key;
+	};
+
+	// i_obj is the value of i_key in a container nested i_depth deep
+	void reach( PDFObject *i_obj, size_t i_depth, Symbol i_key )
+	{
+		if ( i_depth + 1 < kMaxDepth and i_obj->refCount() == 1 and
+			 ( i_obj->isArray() or
+			   ( i_obj->isDictionary() and inlinable( i_obj, i_key ) ) ) )
+		{
+			if ( i_obj->isDictionary() )
+				i_obj->setInlined();
+			_stack.push_back( Item{i_obj, i_depth + 1, i_key} );
+		}
+		else if ( ( i_obj->isArray() or i_obj->isDictionary() or
+					i_obj->isStream() ) and
+				  _seen.insert( i_obj ).second )
+			_stack.push_back( Item{i_obj, 0, kUnknownKey} );
+	}
+
+	static bool inlinable( const PDFObject *i_dict, Symbol i_key )
+	{
+		switch ( i_key )
+		{
+			case kUnknownKey:
+			case sym_Annots:
+			case sym_Fields:
+			case sym_First:
+			case sym_IRT:
+			case sym_Kids:
+			case sym_Last:
+			case sym_Next:
+			case sym_OCGs:
+			case sym_Outlines:
+			case sym_P:
+			case sym_Pages:
+			case sym_Parent:
+			case sym_Pg:
+			case sym_Popup:
+			case sym_Prev:
+			case sym_Threads:
+				return false;
+			default:
+				break;
+		}
+		auto type = i_dict->asDictionary()->value( sym_Type );
+		if ( type == nullptr or type->asName() == nullptr )
+			return true;
+		auto symbol = type->asName()->symbol();
+		return symbol != sym_Catalog and symbol != sym_Page and
+			   symbol != sym_Pages and symbol != sym_Outlines;
+	}
+
+	std::vector<Item> _stack;
+	// indirect containers already followed
+	std::unordered_set<const PDFObject *> _seen;
+};
+
+// Page ordered output: the objects are grouped by the first page using them,
+// so a reader of the output while it is written gets the pages in order.  The
+// catalog and the page tree come first, then the objects used by several
+// pages, the objects of each page, and last the ones of no page like the
+// outlines.  Other pages and the page tree are not followed from a page.  The
+// values of a page tree node, like its inheritable /Resources, go with its
+// first page.
+class PageOrder
+{
+public:
+	PageOrder( std::vector<PDFObject *> &io_objectList )
+		: _objectList( io_objectList )
+	{
+	}
+
+	// Sort the objects, keeping their order in each group.  Returns the
+	// index where each group starts.
+	std::vector<size_t> run( const PDFObject *i_root )
+	{
+		auto pages = collectPages( i_root );
+		for ( size_t i = 0; i < pages.size(); ++i )
+			mark( pages[i], kFirstPage + i );
+
+		std::vector<std::pair<size_t, PDFObject *>> sorted;
+		sorted.reserve( _objectList.size() );
+		for ( auto it : _objectList )
+		{
+			auto found = _groups.find( it );
+			size_t group = kNoPage;
+			if ( found != _groups.end() )
+				group = found->second;
+			sorted.emplace_back( group, it );
+		}
+		std::stable_sort( sorted.begin(), sorted.end(),
+						  []( const std::pair<size_t, PDFObject *> &i_a,
+							  const std::pair<size_t, PDFObject *> &i_b ) {
+							  return i_a.first < i_b.first;
+						  } );
+
+		std::vector<size_t> starts;
+		for ( size_t i = 0; i < sorted.size(); ++i )
+		{
+			if ( i == 0 or sorted[i].first != sorted[i - 1].first )
+				starts.push_back( i );
+			_objectList[i] = sorted[i].second;
+		}
+		return starts;
+	}
+
+private:
+	static const size_t kStructure = 0;
+	static const size_t kShared = 1;
+	static const size_t kFirstPage = 2;
+	static const size_t kNoPage = SIZE_MAX;
+
+	// The pages in order, the catalog and the tree nodes go to kStructure.
+	// The nodes met before a page are kept in _nodes for it.
+	std::vector<const PDFObject *> collectPages( const PDFObject *i_root )
+	{
+		std::vector<const PDFObject *> nodes;
+		std::vector<const PDFObject *> pages;
+		auto catalog = i_root->asDictionary();
+		if ( catalog == nullptr )
+			return pages;
+		_groups[catalog] = kStructure;
+		std::vector<const PDFObject *> stack{catalog->value( sym_Pages )};
+		while ( not stack.empty() )
+		{
+			auto node = stack.back();
+			stack.pop_back();
+			if ( node == nullptr or node->asDictionary() == nullptr or
+				 _groups.count( node ) != 0 )
+				continue;
+			auto kids = node->asDictionary()->value( sym_Kids );
+			if ( kids != nullptr and kids->asArray() != nullptr )
+			{
+				_groups[node] = kStructure;
+				nodes.push_back( node );
+				for ( size_t i = kids->asArray()->count(); i-- > 0; )
+					stack.push_back( kids->asArray()->value( i ) );
+			}
+			else
+			{
+				_groups[node] = kFirstPage + pages.size();
+				_pages.insert( node );
+				_nodes[node].swap( nodes );
+				pages.push_back( node );
+			}
+		}
+		return pages;
+	}
+
+	// Put the objects reached from i_page and the values of its tree nodes in
+	// its group, or in kShared when another page reached them first.  An
+	// object is followed at most twice.
+	void mark( const PDFObject *i_page, size_t i_group )
+	{
+		std::vector<const PDFObject *> stack;
+		auto follow = [&stack]( const PDFObject *i_obj, bool i_node ) {
+			auto array = i_obj->asArray();
+			auto dict = i_obj->isStream() ? i_obj->asStream()->dict()
+										  : i_obj->asDictionary();
+			for ( size_t i = 0; array != nullptr and i < array->count(); ++i )
+				stack.push_back( array->value( i ) );
+			for ( size_t i = 0; dict != nullptr and i < dict->count(); ++i )
+			{
+				ArenaString key;
+				auto value = dict->value( i, key );
+				auto sym = dict->key( i );
+				if ( sym != sym_Parent and ( not i_node or sym != sym_Kids ) )
+					stack.push_back( value );
+			}
+		};
+		follow( i_page, false );
+		auto nodes = _nodes.find( i_page );
+		if ( nodes != _nodes.end() )
+		{
+			for ( auto node : nodes->second )
+				follow( node, true );
+		}
+		while ( not stack.empty() )
+		{
+			auto obj = stack.back();
+			stack.pop_back();
+			auto inserted = _groups.insert( std::make_pair( obj, i_group ) );
+			auto &group = inserted.first->second;
+			if ( not inserted.second )
+			{
+				// the page tree, the pages, or already shared or seen
+				if ( group < kFirstPage or group == i_group or
+					 _pages.count( obj ) != 0 )
+					continue;
+				group = kShared;
+			}
+			follow( obj, false );
+		}
+	}
+
+	std::vector<PDFObject *> &_objectList;
+	std::unordered_map<const PDFObject *, size_t> _groups;
+	std::unordered_set<const PDFObject *> _pages;
+	// the tree nodes whose values go with each page
+	std::unordered_map<const PDFObject *, std::vector<const PDFObject *>>
+		_nodes;
+};
+
+// Number of indirect objects declared by the /Size of the last trailer, 0 if it
+// can't be found.  CoreGraphics doesn't expose it but it is a good hint to size
+// the visited map.
+size_t TrailerObjectCount( const char *i_data, size_t i_size )
+{
+	size_t tail = std::min<size_t>( i_size, 4096 );
+	std::string buffer( i_data + i_size - tail, tail );
+	auto pos = buffer.rfind( "/Size" );
+	if ( pos == std::string::npos )
+		return 0;
+	return strtoul( buffer.c_str() + pos + 5, nullptr, 10 );
+}
+
+size_t TrailerObjectCount( const std::string &i_path )
+{
+	std::ifstream in( i_path, std::ios::binary );
+	if ( not in.seekg( 0, std::ios::end ) )
+		return 0;
+	std::streamoff size = in.tellg();
+	std::streamoff tail = std::min<std::streamoff>( size, 4096 );
+	std::string buffer( (size_t)tail, 0 );
+	if ( not in.seekg( size - tail ) or not in.read( &buffer[0], tail ) )
+		return 0;
+	return TrailerObjectCount( buffer.data(), buffer.size() );
+}
+
+// Convert a document and release it.  i_objectCount, from the trailer, only
+// sizes the tables.
+void ConvertDocument( CGPDFDocumentRef doc, size_t i_objectCount,
+					  OutputSink &s, const SaveOptions &options,
+					  WorkerPool *pool, Incremental *incremental )
+{
+	// released once the visit is done, or when it throws
+	struct Release
+	{
+		~Release()
+		{
+			if ( doc != nullptr )
+				CGPDFDocumentRelease( doc );
+		}
+		CGPDFDocumentRef doc;
+	} release{doc};
+
+	int majorVersion, minorVersion;
+	CGPDFDocumentGetVersion( doc, &majorVersion, &minorVersion );
+
+	auto catalog = CGPDFDocumentGetCatalog( doc );
+	auto info = CGPDFDocumentGetInfo( doc );
+
+	// visit the whole hierarchy
+	Context ctx;
+	ctx.document = doc;
+	ctx.budget = options.budget;
+	// direct objects are visited too, count a few per indirect object
+	ctx.visited.reserve( 4 * i_objectCount );
+	SelectParts( options, ctx );
+	PDFObject *rootObj, *infoObj;
+	{
+		Stats::Timer timer( options.stats, Stats::phase_visit );
+		rootObj = options.pages.empty()
+					  ? VisitDict( catalog, ctx )
+					  : VisitPages( doc, catalog, options, ctx );
+		infoObj = VisitDict( info, ctx );
+	}
+	if ( options.stats != nullptr )
+		options.stats->visited( ctx.visited.lookups(), ctx.visited.hits() );
+
+	// the streams keep the document alive until they are written
+	ctx.visited.clear();
+	CGPDFDocumentRelease( release.doc );
+	release.doc = nullptr;
+
+	if ( options.budget != nullptr )
+		options.budget->checkTime();
+
+	if ( options.dedupe )
+	{
+		Stats::Timer timer( options.stats, Stats::phase_dedupe );
+		Deduplicator( ctx.objectList, options.dedupeContainers )
+			.run( rootObj, infoObj );
+	}
+
+	if ( options.inlineObjects )
+		Inliner().run( rootObj, infoObj );
+
+	std::vector<size_t> groups;
+	if ( options.pageOrder )
+		groups = PageOrder( ctx.objectList ).run( rootObj );
+
+	{
+		Stats::Timer timer( options.stats, Stats::phase_write );
+		SavePDF( s, majorVersion, minorVersion, ctx.objectList, groups,
+				 rootObj, infoObj, options, pool, incremental );
+		s.finish();
+	}
+	if ( options.stats != nullptr )
+	{
+		options.stats->counted( ctx.objectList );
+		options.stats->written( s.offset() );
+	}
+}
+
+// Convert the i_size bytes of a document at i_data, which stay owned by the
+// caller and are not copied.  They must not change until it returns.
+void ConvertBuffer( const void *i_data, size_t i_size, OutputSink &s,
+					const SaveOptions &options, WorkerPool *pool,
+					Incremental *incremental )
+{
+	auto provider = CGDataProviderCreateWithData( nullptr, i_data, i_size,
+												  nullptr );
+	if ( provider == 0 )
+		throw std::runtime_error( "error creating data provider" );
+	auto doc = CGPDFDocumentCreateWithProvider( provider );
+	CGDataProviderRelease( provider );
+	if ( doc == 0 )
+		throw std::runtime_error( "cannot open file" );
+	ConvertDocument( doc, TrailerObjectCount( (const char *)i_data, i_size ),
+					 s, options, pool, incremental );
+}
+
+// Whole standard input, mapped when it is a regular file and read otherwise.
+class StandardInput
+{
+public:
+	StandardInput()
+	{
+		struct stat st;
+		if ( fstat( STDIN_FILENO, &st ) == 0 and S_ISREG( st.st_mode ) and
+			 st.st_size > 0 )
+		{
+			void *data = mmap( nullptr, st.st_size, PROT_READ, MAP_PRIVATE,
+							   STDIN_FILENO, 0 );
+			if ( data != MAP_FAILED )
+			{
+				_mapped = (const char *)data;
+				_size = st.st_size;
+				return;
+			}
+		}
+		char buffer[64 * 1024];
+		for ( ;; )
+		{
+			ssize_t n = read( STDIN_FILENO, buffer, sizeof( buffer ) );
+			if ( n == -1 and errno == EINTR )
+				continue;
+			if ( n == -1 )
+				throw std::runtime_error( "error reading stdin" );
+			if ( n == 0 )
+				break;
+			_read.append( buffer, n );
+		}
+		_size = _read.size();
+	}
+	~StandardInput()
+	{
+		if ( _mapped != nullptr )
+			munmap( (void *)_mapped, _size );
+	}
+
+	StandardInput( const StandardInput & ) = delete;
+	StandardInput &operator=( const StandardInput & ) = delete;
+
+	const char *data() const
+	{
+		return _mapped != nullptr ? _mapped : _read.data();
+	}
+	size_t size() const { return _size; }
+
+private:
+	const char *_mapped{nullptr};
+	std::string _read;
+	size_t _size{0};
+};
+
+// convert the file at i_path, or the standard input for "-"
+void ConvertFile( const std::string &i_path, OutputSink &s,
+				  const SaveOptions &options, WorkerPool *pool,
+				  Incremental *incremental )
+{
+	if ( i_path == "-" )
+	{
+		StandardInput input;
+		ConvertBuffer( input.data(), input.size(), s, options, pool,
+					   incremental );
+		return;
+	}
+
+	auto url = CFURLCreateFromFileSystemRepresentation(
+		0, (const UInt8 *)i_path.c_str(), i_path.size(), false );
+	if ( url == 0 )
+		throw std::runtime_error( "error creating url" );
+	auto doc = CGPDFDocumentCreateWithURL( url );
+	CFRelease( url );
+	if ( doc == 0 )
+		throw std::runtime_error( "cannot open file" );
+	ConvertDocument( doc, TrailerObjectCount( i_path ), s, options, pool,
+					 incremental );
+}
+
+void dictVisitor( const char *key, CGPDFObjectRef value, void *info )
+{
+	std::vector<const char *> *keys = (std::vector<const char *> *)info;
+	keys->push_back( key );
+}
+
+// Dictionaries, arrays and streams are not visited recursively: their
+// creation pushes a VisitFrame and VisitPending() visits their elements.  The
+// objects are added to objectList in the same order as a recursive depth first
+// walk, containers before their elements except streams that come after the
+// objects of their dictionary.
+void BeginDict( CGPDFDictionaryRef dict, PDFDictionary *newDict,
+				PDFStream *newStream, Context &ctx )
+{
+	VisitFrame frame{};
+	frame.dict = dict;
+	frame.newDict = newDict;
+	frame.newStream = newStream;
+	const char *type;
+	if ( ctx.selective and CGPDFDictionaryGetName( dict, "Type", &type ) and
+		 ( strcmp( type, "Page" ) == 0 or strcmp( type, "Pages" ) == 0 ) )
+		frame.filter = filter_page;
+	frame.keyBegin = ctx.visitKeys.size();
+	CGPDFDictionaryApplyFunction( dict, dictVisitor, &ctx.visitKeys );
+	frame.next = frame.keyBegin;
+	frame.end = ctx.visitKeys.size();
+	ctx.visitStack.push_back( frame );
+	if ( ctx.budget != nullptr )
+		ctx.budget->nest( ctx.visitStack.size() );
+}
+
+PDFObject *BeginDict( CGPDFDictionaryRef dict, Context &ctx )
+{
+	size_t count = CGPDFDictionaryGetCount( dict );
+	if ( ctx.budget != nullptr )
+		ctx.budget->reserve( count );
+	auto newDict =
+		ctx.arena.make<PDFDictionary>( ctx.arena, ctx.symbols, count );
+	ctx.objectList.push_back( newDict );
+	BeginDict( dict, newDict, nullptr, ctx );
+	return newDict;
+}
+
+PDFObject *BeginStream( CGPDFStreamRef stream, Context &ctx )
+{
+	auto streamDict = CGPDFStreamGetDictionary( stream );
+	size_t count = CGPDFDictionaryGetCount( streamDict );
+	if ( ctx.budget != nullptr )
+		ctx.budget->reserve( count );
+	auto newDict =
+		ctx.arena.make<PDFDictionary>( ctx.arena, ctx.symbols, count );
+	auto newStream = ctx.arena.make<PDFStream>( newDict, ctx.document, stream,
+												ctx.budget );
+	BeginDict( streamDict, newDict, newStream, ctx );
+	return newStream;
+}
+
+PDFObject *BeginArray( CGPDFArrayRef array, Context &ctx )
+{
+	VisitFrame frame{};
+	frame.array = array;
+	frame.end = CGPDFArrayGetCount( array );
+	if ( ctx.budget != nullptr )
+		ctx.budget->reserve( frame.end );
+	frame.newArray = ctx.arena.make<PDFArray>( ctx.arena, frame.end );
+	ctx.objectList.push_back( frame.newArray );
+	ctx.visitStack.push_back( frame );
+	if ( ctx.budget != nullptr )
+		ctx.budget->nest( ctx.visitStack.size() );
+	return frame.newArray;
+}
+
+// visit the elements of the frames above i_depth
+void VisitPending( size_t i_depth, Context &ctx )
+{
+	while ( ctx.visitStack.size() > i_depth )
+	{
+		// the frame may move when an element pushes a new one
+		auto &frame = ctx.visitStack.back();
+		if ( frame.next == frame.end )
+		{
+			if ( frame.newStream != nullptr )
+				ctx.objectList.push_back( frame.newStream );
+			if ( frame.newDict != nullptr )
+				ctx.visitKeys.resize( frame.keyBegin );
+			ctx.visitStack.pop_back();
+			continue;
+		}
+
+		size_t i = frame.next++;
+		CGPDFObjectRef value;
+		if ( frame.newArray != nullptr )
+		{
+			auto newArray = frame.newArray;
+			if ( CGPDFArrayGetObject( frame.array, i, &value ) )
+				newArray->addValue( VisitObject( value, ctx ) );
+		}
+		else
+		{
+			auto newDict = frame.newDict;
+			auto key = ctx.visitKeys[i];
+			auto filter = frame.filter;
+			if ( CGPDFDictionaryGetObject( frame.dict, key, &value ) )
+			{
+				auto sym = ctx.symbols.intern( key );
+				if ( filter != filter_none and sym < sym_count and
+					 ctx.skipped[filter][sym] )
+					continue;
+				size_t depth = ctx.visitStack.size();
+				newDict->addValue( sym, VisitObject( value, ctx ) );
+				// the resources of the pages are filtered too
+				if ( filter == filter_page and sym == sym_Resources and
+					 ctx.visitStack.size() > depth )
+					ctx.visitStack[depth].filter = filter_resources;
+			}
+		}
+	}
+}
+
+PDFObject *VisitDict( CGPDFDictionaryRef dict, Context &ctx )
+{
+	auto &visit = ctx.visited.findOrInsert( IDRef( dict ) );
+	if ( visit != nullptr )
+	{
+		visit->inc();
+		return visit;
+	}
+
+	if ( ctx.budget != nullptr )
+		ctx.budget->visit();
+	size_t depth = ctx.visitStack.size();
+	auto ptr = visit = BeginDict( dict, ctx );
+	VisitPending( depth, ctx );
+	return ptr;
+}
+
+PDFObject *VisitNull( CGPDFObjectRef obj, Context &ctx )
+{
+	auto newNull = ctx.arena.make<PDFNull>();
+	ctx.objectList.push_back( newNull );
+	return newNull;
+}
+
+PDFObject *VisitInteger( CGPDFObjectRef obj, Context &ctx )
+{
+	CGPDFInteger v;
+	bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeInteger, &v );
+	assert( res );
+	auto newNumber = ctx.arena.make<PDFNumber>( (int)v );
+	ctx.objectList.push_back( newNumber );
+	return newNumber;
+}
+
+PDFObject *VisitFloat( CGPDFObjectRef obj, Context &ctx )
+{
+	CGPDFReal v;
+	bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeReal, &v );
+	assert( res );
+	auto newNumber = ctx.arena.make<PDFNumber>( (double)v );
+	ctx.objectList.push_back( newNumber );
+	return newNumber;
+}
+
+PDFObject *VisitName( CGPDFObjectRef obj, Context &ctx )
+{
+	const char *v;
+	bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeName, &v );
+	assert( res );
+	auto newName =
+		ctx.arena.make<PDFName>( ctx.symbols, ctx.symbols.intern( v ) );
+	ctx.objectList.push_back( newName );
+	return newName;
+}
+
+PDFObject *VisitString( CGPDFObjectRef obj, Context &ctx )
+{
+	CGPDFStringRef v;
+	bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeString, &v );
+	assert( res );
+	auto newString = ctx.arena.make<PDFString>(
+		ctx.arena, (const char *)CGPDFStringGetBytePtr( v ),
+		CGPDFStringGetLength( v ) );
+	ctx.objectList.push_back( newString );
+	return newString;
+}
+
+PDFObject *VisitBoolean( CGPDFObjectRef obj, Context &ctx )
+{
+	CGPDFBoolean b;
+	bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeBoolean, &b );
+	assert( res );
+	auto newBoolean = ctx.arena.make<PDFBoolean>( b );
+	ctx.objectList.push_back( newBoolean );
+	return newBoolean;
+}
+
+// Returns the object for obj, the elements of a new container are visited
+// later by VisitPending().
+PDFObject *VisitObject( CGPDFObjectRef obj, Context &ctx )
+{
+	auto &visit = ctx.visited.findOrInsert( IDRef( obj ) );
+	if ( visit != nullptr )
+	{
+		visit->inc();
+		return visit;
+	}
+
+	if ( ctx.budget != nullptr )
+		ctx.budget->visit();
+	// creating an object doesn't visit anything else, visit stays valid
+	switch ( CGPDFObjectGetType( obj ) )
+	{
+		case kCGPDFObjectTypeNull:
+			return visit = VisitNull( obj, ctx );
+		case kCGPDFObjectTypeBoolean:
+			return visit = VisitBoolean( obj, ctx );
+		case kCGPDFObjectTypeInteger:
+			return visit = VisitInteger( obj, ctx );
+		case kCGPDFObjectTypeReal:
+			return visit = VisitFloat( obj, ctx );
+		case kCGPDFObjectTypeName:
+			return visit = VisitName( obj, ctx );
+		case kCGPDFObjectTypeString:
+			return visit = VisitString( obj, ctx );
+		case kCGPDFObjectTypeArray:
+		{
+			CGPDFArrayRef v;
+			bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeArray, &v );
+			assert( res );
+			return visit = BeginArray( v, ctx );
+		}
+		case kCGPDFObjectTypeDictionary:
+		{
+			CGPDFDictionaryRef v;
+			bool res =
+				CGPDFObjectGetValue( obj, kCGPDFObjectTypeDictionary, &v );
+			assert( res );
+			return visit = BeginDict( v, ctx );
+		}
+		case kCGPDFObjectTypeStream:
+		{
+			CGPDFStreamRef v;
+			bool res = CGPDFObjectGetValue( obj, kCGPDFObjectTypeStream, &v );
+			assert( res );
+			return visit = BeginStream( v, ctx );
+		}
+		default:
+			assert( false );
+			break;
+	}
+	return visit = ctx.arena.make<PDFNull>();
+}
+
+// objects made by the converter, not in the document
+PDFDictionary *NewDict( size_t i_capacity, Context &ctx )
+{
+	auto newDict =
+		ctx.arena.make<PDFDictionary>( ctx.arena, ctx.symbols, i_capacity );
+	ctx.objectList.push_back( newDict );
+	return newDict;
+}
+
+PDFObject *NewName( Symbol i_symbol, Context &ctx )
+{
+	auto newName = ctx.arena.make<PDFName>( ctx.symbols, i_symbol );
+	ctx.objectList.push_back( newName );
+	return newName;
+}
+
+PDFObject *NewInteger( int i_value, Context &ctx )
+{
+	auto newNumber = ctx.arena.make<PDFNumber>( i_value );
+	ctx.objectList.push_back( newNumber );
+	return newNumber;
+}
+
+// Visit a value and its elements.  With a page filter, the resources are
+// filtered like the ones found in the pages.
+PDFObject *VisitValue( CGPDFObjectRef value, Symbol i_key, Context &ctx )
+{
+	size_t depth = ctx.visitStack.size();
+	auto obj = VisitObject( value, ctx );
+	if ( i_key == sym_Resources and ctx.visitStack.size() > depth )
+		ctx.visitStack[depth].filter = filter_resources;
+	VisitPending( depth, ctx );
+	return obj;
+}
+
+// keys skipped in page tree nodes and their resources for the selection
+void SelectParts( const SaveOptions &options, Context &ctx )
+{
+	auto &page = ctx.skipped[filter_page];
+	auto &resources = ctx.skipped[filter_resources];
+	page[sym_Contents] = not( options.parts & part_contents );
+	page[sym_Annots] = not( options.parts & part_annots );
+	resources[sym_Font] = not( options.parts & part_fonts );
+	resources[sym_XObject] = not( options.parts & part_images );
+	resources[sym_Shading] = not( options.parts & part_functions );
+	resources[sym_Pattern] = not( options.parts & part_functions );
+	resources[sym_ColorSpace] = not( options.parts & part_colorspaces );
+	resources[sym_ExtGState] = not( options.parts & part_extgstates );
+	// VisitPages() makes a new page tree
+	page[sym_Parent] = not options.pages.empty();
+	ctx.selective = options.parts != part_all or not options.pages.empty();
+}
+
+// Catalog of a document made of the selected pages.  The pages are visited
+// without their parent, which would bring the whole page tree, and get the
+// attributes they inherited from it.  A new page tree holds them.
+PDFObject *VisitPages( CGPDFDocumentRef doc, CGPDFDictionaryRef catalog,
+					   const SaveOptions &options, Context &ctx )
+{
+	size_t count = CGPDFDocumentGetNumberOfPages( doc );
+	std::vector<bool> selected( count + 1 );
+	for ( auto &it : options.pages )
+	{
+		for ( size_t p = std::max<size_t>( it.first, 1 );
+			  p <= std::min( it.second, count ); ++p )
+			selected[p] = true;
+	}
+
+	auto newCatalog = NewDict( 8, ctx );
+	auto newPages = NewDict( 4, ctx );
+	auto kids = ctx.arena.make<PDFArray>( ctx.arena, 0 );
+	ctx.objectList.push_back( kids );
+	newCatalog->addValue( sym_Type, NewName( sym_Catalog, ctx ) );
+	newCatalog->addValue( sym_Pages, newPages );
+	newPages->addValue( sym_Type, NewName( sym_Pages, ctx ) );
+	newPages->addValue( sym_Kids, kids );
+
+	// document level entries that don't refer to the pages
+	for ( auto key : {"Lang", "MarkInfo", "Metadata", "OutputIntents",
+					  "ViewerPreferences"} )
+	{
+		CGPDFObjectRef value;
+		if ( CGPDFDictionaryGetObject( catalog, key, &value ) )
+		{
+			auto sym = ctx.symbols.intern( key );
+			newCatalog->addValue( sym, VisitValue( value, sym, ctx ) );
+		}
+	}
+
+	const Symbol inherited[] = {sym_Resources, sym_MediaBox, sym_CropBox,
+								sym_Rotate};
+	int pageCount = 0;
+	for ( size_t p = 1; p <= count; ++p )
+	{
+		if ( not selected[p] )
+			continue;
+		auto dict = CGPDFPageGetDictionary( CGPDFDocumentGetPage( doc, p ) );
+		auto page = VisitDict( dict, ctx )->asDictionary();
+		if ( page == nullptr )
+			continue;
+		for ( auto sym : inherited )
+		{
+			if ( page->value( sym ) != nullptr )
+				continue;
+			// the depth bounds malformed cyclic trees
+			CGPDFDictionaryRef node = dict, parent;
+			CGPDFObjectRef value;
+			for ( int depth = 0;
+				  depth < 64 and
+				  CGPDFDictionaryGetDictionary( node, "Parent", &parent );
+				  ++depth, node = parent )
+			{
+				if ( CGPDFDictionaryGetObject(
+						 parent, ctx.symbols.name( sym ).data(), &value ) )
+				{
+					page->addValue( sym, VisitValue( value, sym, ctx ) );
+					break;
+				}
+			}
+		}
+		page->addValue( sym_Parent, newPages );
+		newPages->inc();
+		kids->addValue( page );
+		++pageCount;
+	}
+	newPages->addValue( sym_Count, NewInteger( pageCount, ctx ) );
+	return newCatalog;
+}
+
+PDF2TextSession::PDF2TextSession( const SessionSettings &i_settings )
+	: _settings( i_settings )
+{
+	if ( _settings.threads == 0 )
+		_settings.threads = std::max( 1u, std::thread::hardware_concurrency() );
+	if ( _settings.threads > 1 )
+		_pool.reset( new WorkerPool( _settings.threads ) );
+	if ( _settings.spillSize > 0 )
+	{
+		if ( _settings.spillDir.empty() )
+		{
+			const char *tmp = getenv( "TMPDIR" );
+			_settings.spillDir = tmp != nullptr and *tmp != 0 ? tmp : "/tmp";
+		}
+		_spill.reset( new SpillFile( _settings.spillSize, _settings.spillDir ) );
+	}
+	if ( _settings.cacheSize > 0 or not _settings.cacheDir.empty() )
+	{
+		// a directory alone still gets a memory budget
+		if ( _settings.cacheSize == 0 )
+			_settings.cacheSize = size_t( 256 ) << 20;
+		_cache.reset( new StreamCache( _settings.cacheSize, _settings.cacheDir,
+									   _spill.get() ) );
+	}
+	// 64 MB of arena blocks kept for the next documents
+	if ( _settings.recycleArenas )
+		Arena::recycle( 1024 );
+}
+
+PDF2TextSession::~PDF2TextSession() = default;
+
+void PDF2TextSession::convert( const ConvertInput &i_input, OutputSink &s,
+							   const ConvertOptions &i_options,
+							   std::string *o_stats )
+{
+	SaveOptions save;
+	static_cast<ConvertOptions &>( save ) = i_options;
+	save.cache = _cache.get();
+	save.spill = _spill.get();
+	Stats stats;
+	if ( o_stats != nullptr )
+		save.stats = &stats;
+	// the deadline counts from here, reading the input included
+	std::unique_ptr<Budget> budget;
+	if ( not Budget::unlimited( i_options ) )
+		budget.reset( new Budget( i_options ) );
+	save.budget = budget.get();
+	try
+	{
+		std::unique_ptr<Incremental> incremental;
+		if ( not i_options.previous.empty() or not i_options.manifest.empty() )
+			incremental.reset( new Incremental );
+		if ( not i_options.previous.empty() )
+			incremental->open( i_options.previous );
+
+		if ( i_input.data != nullptr )
+			ConvertBuffer( i_input.data, i_input.size, s, save, _pool.get(),
+						   incremental.get() );
+		else
+			ConvertFile( i_input.name, s, save, _pool.get(),
+						 incremental.get() );
+		if ( not i_options.manifest.empty() )
+			incremental->current().write( i_options.manifest );
+	}
+	catch ( std::exception &ex )
+	{
+		if ( o_stats != nullptr )
+			*o_stats = stats.json( i_input.name, ex.what() );
+		throw;
+	}
+	if ( o_stats != nullptr )
+		*o_stats = stats.json( i_input.name, nullptr );
+}
+
+std::string PDF2TextSession::errorStats( const std::string &i_name,
+										 const std::string &i_error )
+{
+	return Stats().json( i_name, i_error.c_str() );
+}
@@ -0,0 +1,509 @@
+// Conversion of PDF documents to a form that can be edited in a text editor:
+// every stream is written with an ASCII encoding, or as is when it is already
+// text.  A PDF2TextSession converts documents from files or buffers to an
+// OutputSink.
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Buffered output of a converted document.  The sink keeps track of the
+// offset itself, and only writes to its backend in large blocks.
+class OutputSink
+{
+public:
+	// the buffer is aligned and a multiple of kBlockAlignment for direct I/O,
+	// of two blocks at least so that one can be reserved
+	static const size_t kBlockAlignment = 4096;
+
+	OutputSink( size_t i_capacity = 1024 * 1024 )
+		: _capacity( std::max( 2 * kBlockAlignment,
+							   i_capacity / kBlockAlignment * kBlockAlignment ) )
+	{
+		void *buffer = nullptr;
+		if ( posix_memalign( &buffer, kBlockAlignment, _capacity ) != 0 )
+			throw std::bad_alloc();
+		_buffer.reset( (char *)buffer );
+	}
+	virtual ~OutputSink() = default;
+
+	// number of bytes written so far
+	uint64_t offset() const { return _flushed + _used; }
+
+	void put( char i_c )
+	{
+		if ( _used == _capacity )
+			drain();
+		_buffer.get()[_used++] = i_c;
+	}
+
+	void write( const char *i_data, size_t i_size )
+	{
+		// large blocks don't need to go through the buffer
+		if ( i_size >= _capacity and unbuffered() )
+		{
+			// the whole buffer goes first, the backend takes any size
+			output( _buffer.get(), _used, false );
+			_flushed += _used;
+			_used = 0;
+			output( i_data, i_size, false );
+			_flushed += i_size;
+			return;
+		}
+		while ( i_size > 0 )
+		{
+			if ( _used == _capacity )
+				drain();
+			size_t n = std::min( i_size, _capacity - _used );
+			memcpy( _buffer.get() + _used, i_data, n );
+			_used += n;
+			i_data += n;
+			i_size -= n;
+		}
+	}
+
+	// Get room for i_size bytes, at most maxReserve(), to write to directly
+	// before calling commit().  With direct I/O, up to a partial block stays
+	// in the buffer.
+	size_t capacity() const { return _capacity; }
+	size_t maxReserve() const
+	{
+		return unbuffered() ? _capacity : _capacity - kBlockAlignment;
+	}
+	char *reserve( size_t i_size )
+	{
+		if ( i_size > maxReserve() )
+			throw std::runtime_error( "reserve larger than the output buffer" );
+		if ( _capacity - _used < i_size )
+		{
+			// the backend takes any size, the whole buffer can go
+			if ( unbuffered() )
+			{
+				output( _buffer.get(), _used, false );
+				_flushed += _used;
+				_used = 0;
+			}
+			else
+				drain();
+		}
+		assert( _capacity - _used >= i_size );
+		return _buffer.get() + _used;
+	}
+	void commit( size_t i_size ) { _used += i_size; }
+
+	// Write the buffered bytes to the backend, but a partial block with
+	// direct I/O.
+	void flush()
+	{
+		if ( not unbuffered() )
+		{
+			drain();
+			return;
+		}
+		output( _buffer.get(), _used, false );
+		_flushed += _used;
+		_used = 0;
+	}
+
+	// write everything, must be called once the document is written
+	void finish()
+	{
+		output( _buffer.get(), _used, true );
+		_flushed += _used;
+		_used = 0;
+	}
+
+protected:
+	// Write i_size bytes to the backend.  Unless i_last, only full buffers or
+	// unbuffered blocks are written.
+	virtual void output( const char *i_data, size_t i_size, bool i_last ) = 0;
+	virtual bool unbuffered() const { return true; }
+
+private:
+	void drain()
+	{
+		if ( _used == _capacity )
+		{
+			output( _buffer.get(), _used, false );
+			_flushed += _used;
+			_used = 0;
+			return;
+		}
+		// keep the writes block aligned, only write the full blocks
+		size_t n = _used / kBlockAlignment * kBlockAlignment;
+		if ( n == 0 )
+			return;
+		output( _buffer.get(), n, false );
+		_flushed += n;
+		_used -= n;
+		memmove( _buffer.get(), _buffer.get() + n, _used );
+	}
+
+	struct FreeDeleter
+	{
+		void operator()( char *i_ptr ) const { free( i_ptr ); }
+	};
+
+	std::unique_ptr<char, FreeDeleter> _buffer;
+	size_t _capacity;
+	size_t _used{0};
+	uint64_t _flushed{0};
+};
+
+// sink writing to a std::ostream
+class StreamSink : public OutputSink
+{
+public:
+	StreamSink( std::ostream &i_stream ) : _stream( i_stream ) {}
+
+protected:
+	void output( const char *i_data, size_t i_size, bool i_last ) override
+	{
+		if ( not _stream.write( i_data, i_size ) or
+			 ( i_last and not _stream.flush() ) )
+			throw std::runtime_error( "error writing output" );
+	}
+
+private:
+	std::ostream &_stream;
+};
+
+// Sink writing to a file descriptor.  The files it opens are written with
+// pwrite, other descriptors like stdout sequentially.  With direct I/O the
+// page cache is bypassed (O_DIRECT, F_NOCACHE on macOS).
+class FileSink : public OutputSink
+{
+public:
+	FileSink( int i_fd, bool i_owned, bool i_direct = false )
+		: _fd( i_fd ), _owned( i_owned ), _direct( false )
+	{
+		_position = i_owned ? lseek( _fd, 0, SEEK_CUR ) : -1;
+		if ( i_direct and _position >= 0 and
+			 _position % kBlockAlignment == 0 )
+		{
+#if defined( O_DIRECT )
+			int flags = fcntl( _fd, F_GETFL );
+			_direct = flags != -1 and
+					  fcntl( _fd, F_SETFL, flags | O_DIRECT ) != -1;
+#elif defined( F_NOCACHE )
+			fcntl( _fd, F_NOCACHE, 1 );
+#endif
+		}
+	}
+
+	~FileSink()
+	{
+		if ( _owned )
+			close( _fd );
+	}
+
+	static std::unique_ptr<FileSink> create( const std::string &i_path,
+											 bool i_direct )
+	{
+		int fd = open( i_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+		if ( fd == -1 )
+			throw std::runtime_error( "cannot create output file" );
+		return std::unique_ptr<FileSink>( new FileSink( fd, true, i_direct ) );
+	}
+
+protected:
+	void output( const char *i_data, size_t i_size, bool i_last ) override
+	{
+		size_t size = i_size;
+		if ( _direct and i_size % kBlockAlignment != 0 )
+		{
+			// only the last block can be partial, it is padded in the buffer
+			// and the file truncated after
+			assert( i_last );
+			size = ( i_size / kBlockAlignment + 1 ) * kBlockAlignment;
+			memset( (char *)i_data + i_size, 0, size - i_size );
+		}
+
+		for ( size_t done = 0; done < size; )
+		{
+			ssize_t n = _position >= 0
+							? pwrite( _fd, i_data + done, size - done,
+									  _position + done )
+							: ::write( _fd, i_data + done, size - done );
+			if ( n < 0 and errno == EINTR )
+				continue;
+			if ( n <= 0 )
+				throw std::runtime_error( "error writing output" );
+			done += n;
+		}
+		if ( _position >= 0 )
+		{
+			_position += i_size;
+			if ( size != i_size and ftruncate( _fd, _position ) != 0 )
+				throw std::runtime_error( "error writing output" );
+		}
+	}
+
+	bool unbuffered() const override { return not _direct; }
+
+private:
+	int _fd;
+	bool _owned;
+	bool _direct;
+	off_t _position;
+};
+
+// how the stream bodies that are not text are written
+enum encoding_t
+{
+	encoding_none,
+	encoding_hex,
+	encoding_ascii85
+};
+
+// parts of the pages that can be selected
+enum page_part_t : unsigned
+{
+	part_contents = 1 << 0,
+	part_annots = 1 << 1,
+	part_fonts = 1 << 2,
+	part_images = 1 << 3,
+	part_functions = 1 << 4,
+	part_colorspaces = 1 << 5,
+	part_extgstates = 1 << 6,
+
+	part_all = ( 1 << 7 ) - 1
+};
+
+// how the encoding and compression of each stream are chosen
+enum optimize_t
+{
+	// from encoding and flate
+	optimize_none,
+	// smallest ASCII output, compressed when it pays off
+	optimize_size,
+	// least CPU: never compressed nor scanned, the bodies known to be text
+	// as they are, the others in hex
+	optimize_speed,
+	// the bodies made of text as they are, the others in hex
+	optimize_editable
+};
+
+// how a document is converted
+struct ConvertOptions
+{
+	// with threads, number of streams encoded ahead of the writer
+	size_t window{16};
+	encoding_t encoding{encoding_hex};
+	// compress the stream bodies with FlateDecode, at flateLevel from 0 to 9,
+	// -1 for the zlib default
+	bool flate{false};
+	int flateLevel{-1};
+	// when not optimize_none, chooses for each stream instead of encoding
+	// and flate
+	optimize_t optimize{optimize_none};
+	// collapse the streams with the same content before saving, and the
+	// dictionaries and arrays with dedupeContainers
+	bool dedupe{false};
+	bool dedupeContainers{false};
+	// write the dictionaries used once in the object using them, where the
+	// spec allows it
+	bool inlineObjects{false};
+	// pack the objects that aren't streams in object streams, and write the
+	// xref as a stream, from PDF 1.5
+	bool objectStreams{false};
+	// write the objects grouped by the first page using them, and flush the
+	// output after each group
+	bool pageOrder{false};
+	// write the page content streams one operator per line
+	bool prettyContents{false};
+	// selected page ranges, from 1 and inclusive, all pages when empty
+	std::vector<std::pair<size_t, size_t>> pages;
+	// page_part_t kept in the pages
+	unsigned parts{part_all};
+	// budgets of the document, 0 for no limit: the conversion fails as soon
+	// as one is exceeded.  The objects visited, how deep they are nested, the
+	// decoded size of a stream and of all of them, and the seconds from the
+	// start of the conversion.
+	size_t maxObjects{0};
+	size_t maxDepth{0};
+	size_t maxStreamSize{0};
+	size_t maxDecodedSize{0};
+	double timeout{0};
+	// Incremental conversion: the unchanged streams are copied from the
+	// previous output, found with the manifest next to it, and the manifest
+	// of this output is written to manifest.  Both can be empty.
+	std::string previous;
+	std::string manifest;
+};
+
+// what a session shares between the documents it converts
+struct SessionSettings
+{
+	// threads encoding the streams of a document, 0 for one per core
+	size_t threads{1};
+	// stream cache budget in bytes, 0 without cache
+	size_t cacheSize{0};
+	// also keep the cached streams in this directory, across sessions
+	std::string cacheDir;
+	// stream bodies from spillSize bytes go to a file in spillDir, $TMPDIR by
+	// default, 0 for none
+	size_t spillSize{0};
+	std::string spillDir;
+	// keep the memory of the converted documents for the next ones
+	bool recycleArenas{false};
+};
+
+// a document to convert, from a file or "-" for stdin, or from memory
+struct ConvertInput
+{
+	static ConvertInput file( const std::string &i_path )
+	{
+		ConvertInput input;
+		input.name = i_path;
+		return input;
+	}
+	// the data stays owned by the caller, and is not copied
+	static ConvertInput buffer( const void *i_data, size_t i_size,
+								const std::string &i_name = "buffer" )
+	{
+		ConvertInput input;
+		input.name = i_name;
+		input.data = i_data;
+		input.size = i_size;
+		return input;
+	}
+
+	// the path of a file, a name for the stats of a buffer
+	std::string name;
+	const void *data{nullptr};
+	size_t size{0};
+};
+
+// fixed set of threads running queued tasks
+class WorkerPool
+{
+public:
+	WorkerPool( size_t i_threads )
+	{
+		for ( size_t i = 0; i < i_threads; ++i )
+			_threads.emplace_back( [this] { run(); } );
+	}
+
+	~WorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock( _mutex );
+			_stop = true;
+		}
+		_wakeUp.notify_all();
+		for ( auto &it : _threads )
+			it.join();
+	}
+
+	size_t size() const { return _threads.size(); }
+
+	void post( std::function<void()> i_task )
+	{
+		{
+			std::lock_guard<std::mutex> lock( _mutex );
+			_tasks.push_back( std::move( i_task ) );
+		}
+		_wakeUp.notify_one();
+	}
+
+	// post a task and get a future on its result
+	template <class F>
+	auto submit( F i_task ) -> std::future<decltype( i_task() )>
+	{
+		typedef decltype( i_task() ) result_t;
+		auto task =
+			std::make_shared<std::packaged_task<result_t()>>( std::move( i_task ) );
+		auto result = task->get_future();
+		post( [task] { ( *task )(); } );
+		return result;
+	}
+
+	// wait until all the posted tasks are done
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock( _mutex );
+		_idle.wait( lock, [this] { return _tasks.empty() and _busy == 0; } );
+	}
+
+private:
+	void run()
+	{
+		std::unique_lock<std::mutex> lock( _mutex );
+		for ( ;; )
+		{
+			_wakeUp.wait( lock, [this] { return _stop or not _tasks.empty(); } );
+			if ( _tasks.empty() )
+				return;
+			auto task = std::move( _tasks.front() );
+			_tasks.pop_front();
+			++_busy;
+			lock.unlock();
+			task();
+			lock.lock();
+			if ( --_busy == 0 and _tasks.empty() )
+				_idle.notify_all();
+		}
+	}
+
+	std::vector<std::thread> _threads;
+	std::deque<std::function<void()>> _tasks;
+	std::mutex _mutex;
+	std::condition_variable _wakeUp;
+	std::condition_variable _idle;
+	size_t _busy{0};
+	bool _stop{false};
+};
+
+class SpillFile;
+class StreamCache;
+
+// Converts documents with a thread pool, spill file and stream cache shared
+// by all of them.  Several documents can be converted at once from different
+// threads.
+class PDF2TextSession
+{
+public:
+	// throws std::runtime_error when the spill file can't be created
+	explicit PDF2TextSession(
+		const SessionSettings &i_settings = SessionSettings() );
+	~PDF2TextSession();
+
+	PDF2TextSession( const PDF2TextSession & ) = delete;
+	PDF2TextSession &operator=( const PDF2TextSession & ) = delete;
+
+	// Convert i_input to s, and finish it.  Throws std::runtime_error.  With
+	// o_stats, it gets a line of JSON with the timing and counters of the
+	// conversion, also when it fails.
+	void convert( const ConvertInput &i_input, OutputSink &s,
+				  const ConvertOptions &i_options,
+				  std::string *o_stats = nullptr );
+
+	// stats line of a conversion that failed before it started
+	static std::string errorStats( const std::string &i_name,
+								   const std::string &i_error );
+
+private:
+	SessionSettings _settings;
+	std::unique_ptr<WorkerPool> _pool;
+	std::unique_ptr<SpillFile> _spill;
+	std::unique_ptr<StreamCache> _cache;
+};